@@ -1,24 +1,114 @@
 #include "arealight.h"
 #include "raytracer.h"
 #include "raymath.h"
+#include "sampler.h"
 
-#define RAND ((float)rand() / RAND_MAX) // random number between 0 and 1
+bool adaptiveAreaSampling = true;
+
+// the sample points and probe flags of the light being sampled, kept per thread so shading
+// points don't allocate them
+static thread_local std::vector<glm::vec2> lightSamples;
+static thread_local std::vector<bool> lightProbes;
+
+int AreaLight::sampleCount() {
+	return lightSampleCount(numSamples);
+}
+
+void AreaLight::addShadowRays(point3 p, std::vector<ShadowRay>& rays) {
+	if (previewShading && numSamples > 0) {
+		// the centre of the light stands in for all of it
+		ShadowRay ray;
+		samplePoint(glm::vec2(0.5f, 0.5f), ray.lightPos);
+		rays.push_back(ray);
+		return;
+	}
+
+	int count = sampleCount();
+	std::vector<glm::vec2>& samples = lightSamples;
+	threadSampler().generate2D(count, samples);
+
+	// adaptive sampling traces the first sample in each quadrant of the light as a probe, and
+	// the rest only if the probes disagree; the probes count towards the estimate either way
+	std::vector<bool>& probe = lightProbes;
+	probe.assign(count, false);
+	int probes = 0;
+	if (adaptiveAreaSampling && count > ADAPTIVE_PROBES) {
+		bool quadrants[ADAPTIVE_PROBES] = { false, false, false, false };
+		for (int i = 0; i < count; i++) {
+			int quadrant = (samples[i].x >= 0.5f ? 1 : 0) + (samples[i].y >= 0.5f ? 2 : 0);
+			if (!quadrants[quadrant]) {
+				quadrants[quadrant] = true;
+				probe[i] = true;
+				probes++;
+			}
+		}
+	}
+	bool adaptive = probes > 1;
+
+	// the probes go first, where shadePoint looks for them
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < count; i++) {
+			if (probe[i] != (pass == 0))
+				continue;
+			ShadowRay ray;
+			samplePoint(samples[i], ray.lightPos);
+			ray.probe = adaptive && probe[i];
+			ray.deferred = adaptive && !probe[i];
+			rays.push_back(ray);
+		}
+	}
+}
+
+void AreaLight::shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) {
+	if (numSamples <= 0)
+		return;
+
+	int count = sampleCount();
+	int probes = 0;
+	while (probes < count && rays[probes].probe)
+		probes++;
+
+	std::vector<ShadowRay> samples(rays, rays + count);
+	int traced = count;
+
+	if (probes > 0) {
+		bool agree = true;
+		for (int i = 1; i < probes; i++) {
+			if (samples[i].lit != samples[0].lit || (samples[i].lit && samples[i].shadow != samples[0].shadow))
+				agree = false;
+		}
+
+		if (agree) {
+			// fully lit or fully shadowed: the rest of the light is assumed to be seen like the probes
+			for (int i = probes; i < count; i++) {
+				samples[i].lit = samples[0].lit;
+				samples[i].shadow = samples[0].shadow;
+			}
+			traced = probes;
+		}
+		else {
+			// penumbra: trace the rest, keeping what the probes found
+			for (int i = 0; i < count; i++)
+				samples[i].deferred = i < probes;
+			shadowRays(p, samples);
+		}
+	}
+
+	shadedPoints.fetch_add(1, std::memory_order_relaxed);
+	tracedRays.fetch_add(traced, std::memory_order_relaxed);
+	countSampledShadowRays(traced);
 
-void AreaLight::lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) {
 	colour3 totalColour = colour3(0.0, 0.0, 0.0);
-	for (int i = 0; i < numSamples; i++) {
-		point3 lightPos;
-		randomPoint(lightPos);
-		colour3 shadow = colour3(1.0, 1.0, 1.0);
-		if (shadowRay(p, lightPos, shadow)) {
-			colour3 I = colour * shadow;
-			point3 L = glm::normalize(lightPos - p);
+	for (int i = 0; i < count; i++) {
+		if (samples[i].lit) {
+			colour3 I = colour * samples[i].shadow;
+			point3 L = glm::normalize(samples[i].lightPos - p);
 
 			addDiffuse(I, material.diffuse, N, L, totalColour);
 			addSpecular(I, material.specular, material.shininess, N, L, V, totalColour);
 		}
 	}
-	pointColour += totalColour / float(numSamples);
+	pointColour += totalColour / float(count);
 }
 
 RectangularAreaLight::RectangularAreaLight(colour3 colour, point3 position, point3 normal, float width, float height, point3 orientation, int numSamples) {
@@ -34,31 +124,24 @@ RectangularAreaLight::RectangularAreaLight(colour3 colour, point3 position, poin
 	planeY = glm::normalize(glm::cross(normal, planeX));
 }
 
-void RectangularAreaLight::randomPoint(point3& p) {
-	float xDisplacement = (RAND - 0.5) * width;
-	float yDisplacement = (RAND - 0.5) * height;
+void RectangularAreaLight::samplePoint(glm::vec2 u, point3& p) {
+	float xDisplacement = (u.x - 0.5) * width;
+	float yDisplacement = (u.y - 0.5) * height;
 
 	p = position + planeX * xDisplacement + planeY * yDisplacement;
 }
 
-void RectangularAreaLight::preparePoints() {
-	step = 1.0 / sqrt(numSamples);
-	x = 0.5 * step;
-	y = 0.5 * step;
-}
-
-void RectangularAreaLight::nextPoint(point3& p) {
-	float xDisplacement = (x - 0.5) * width;
-	float yDisplacement = (y - 0.5) * height;
-
-	p = position + planeX * xDisplacement + planeY * yDisplacement;
-
-	if (x < 1.0)
-		x += step;
-	else {
-		x = 0.5 * step;
-		y += step;
-	}
+bool RectangularAreaLight::getBounds(BoundingBox& box) {
+	// the extent along each axis is half the rectangle projected onto it
+	point3 extent = (glm::abs(planeX) * width + glm::abs(planeY) * height) / 2.0f;
+
+	box.minX = position.x - extent.x;
+	box.maxX = position.x + extent.x;
+	box.minY = position.y - extent.y;
+	box.maxY = position.y + extent.y;
+	box.minZ = position.z - extent.z;
+	box.maxZ = position.z + extent.z;
+	return true;
 }
 
 CircularAreaLight::CircularAreaLight(colour3 colour, point3 position, point3 normal, float radius, int numSamples) {
@@ -76,9 +159,25 @@ CircularAreaLight::CircularAreaLight(colour3 colour, point3 position, point3 nor
 	planeY = glm::normalize(glm::cross(normal, planeX));
 }
 
-void CircularAreaLight::randomPoint(point3& p) {
-	float angle = RAND * 2 * M_PI;
-	float displacement = radius * sqrt(RAND);
+void CircularAreaLight::samplePoint(glm::vec2 u, point3& p) {
+	// concentric mapping from square to disk (Shirley & Chiu), which keeps stratified
+	// samples stratified, unlike the polar (angle, sqrt(r)) mapping
+	float a = 2 * u.x - 1;
+	float b = 2 * u.y - 1;
+	float displacement, angle;
+
+	if (a == 0 && b == 0) {
+		displacement = 0;
+		angle = 0;
+	}
+	else if (abs(a) > abs(b)) {
+		displacement = radius * a;
+		angle = (M_PI / 4) * (b / a);
+	}
+	else {
+		displacement = radius * b;
+		angle = (M_PI / 2) - (M_PI / 4) * (a / b);
+	}
 
 	float xDisplacement = displacement * cos(angle);
 	float yDisplacement = displacement * sin(angle);
@@ -86,10 +185,15 @@ void CircularAreaLight::randomPoint(point3& p) {
 	p = position + planeX * xDisplacement + planeY * yDisplacement;
 }
 
-void CircularAreaLight::preparePoints() {
-	return;
-}
-
-void CircularAreaLight::nextPoint(point3& p) {
-	randomPoint(p);
+bool CircularAreaLight::getBounds(BoundingBox& box) {
+	// the extent of a disk along each axis is its radius scaled by how far the disk's plane spans that axis
+	point3 extent = radius * glm::sqrt(planeX * planeX + planeY * planeY);
+
+	box.minX = position.x - extent.x;
+	box.maxX = position.x + extent.x;
+	box.minY = position.y - extent.y;
+	box.maxY = position.y + extent.y;
+	box.minZ = position.z - extent.z;
+	box.maxZ = position.z + extent.z;
+	return true;
 }
\ No newline at end of file
@@ -3,6 +3,12 @@
 
 #include "objects.h"
 
+#include <atomic>
+
+#define ADAPTIVE_PROBES 4 // samples traced before deciding whether a point is in penumbra, one per quadrant of the light
+
+extern bool adaptiveAreaSampling;
+
 class AreaLight : public Light {
 public:
 	point3 position;
@@ -10,10 +16,12 @@ public:
 	point3 planeX;
 	point3 planeY;
 	int numSamples;
-	void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour);
-	virtual void randomPoint(point3 &p) = 0;
-	virtual void preparePoints() = 0;
-	virtual void nextPoint(point3& p) = 0;
+	std::atomic<unsigned long long> shadedPoints{ 0 };
+	std::atomic<unsigned long long> tracedRays{ 0 };
+	int sampleCount(); // fewer while previewing, or to fit a time budget
+	void addShadowRays(point3 p, std::vector<ShadowRay>& rays);
+	void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour);
+	virtual void samplePoint(glm::vec2 u, point3 &p) = 0; // maps a point in the unit square onto the light
 };
 
 class RectangularAreaLight : public AreaLight {
@@ -21,22 +29,16 @@ public:
 	float width;
 	float height;
 	RectangularAreaLight(colour3 colour, point3 position, point3 normal, float width, float height, point3 orientation, int numSamples);
-	void randomPoint(point3& p);
-	void preparePoints();
-	void nextPoint(point3& p);
-private:
-	float x;
-	float y;
-	float step;
+	void samplePoint(glm::vec2 u, point3& p);
+	bool getBounds(BoundingBox& box);
 };
 
 class CircularAreaLight : public AreaLight {
 public:
 	float radius;
 	CircularAreaLight(colour3 colour, point3 position, point3 normal, float radius, int numSamples);
-	void randomPoint(point3& p);
-	void preparePoints();
-	void nextPoint(point3& p);
+	void samplePoint(glm::vec2 u, point3& p);
+	bool getBounds(BoundingBox& box);
 };
 
 #endif
\ No newline at end of file
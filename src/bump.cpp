@@ -1,34 +1,54 @@
 #include "bump.h"
+#include "raytracer.h"
+
+#include <algorithm>
+#include <cmath>
 
 BumpSphere::BumpSphere(point3 center, float radius, Material material, std::string bumpmapfile, float bumpDepth) : Sphere::Sphere(center, radius, material) {
-	this->bumpmap.ReadFromFile(bumpmapfile.c_str());
+	this->bumpmap = textureCache.find(bumpmapfile, TextureGradient);
 	this->bumpDepth = bumpDepth;
 }
 
+// Polynomial arctangent for |x| <= 1, accurate to about 1e-5 radians, which is well
+// under a texel for any bump map that fits in memory.
+static float fastAtan(float x) {
+	float x2 = x * x;
+	return x * (0.99997726f + x2 * (-0.33262347f + x2 * (0.19354346f + x2 * (-0.11643287f + x2 * (0.05265332f + x2 * -0.01172120f)))));
+}
+
+static float fastAtan2(float y, float x) {
+	float ay = std::abs(y);
+	float ax = std::abs(x);
+	if (ax == 0 && ay == 0)
+		return 0;
+
+	float angle = ay > ax ? float(M_PI / 2) - fastAtan(ax / ay) : fastAtan(ay / ax);
+	if (x < 0)
+		angle = float(M_PI) - angle;
+	return y < 0 ? -angle : angle;
+}
+
 void BumpSphere::getNormal(point3& n) {
 	//get actual surface normal
 	point3 trueNormal;
 	Sphere::getNormal(trueNormal);
 
-	// determine UV coords of the hitpoint
-	float u = 0.5 - atan2(-trueNormal.z, -trueNormal.x) / (2 * M_PI);
-	float v = 0.5 - asin(trueNormal.y) / M_PI;
-
-	// read bumpmap value at UV point
-	int height = bumpmap.TellHeight();
-	int width = bumpmap.TellWidth();
-
-	float value = float(bumpmap(int(u * width), int(v * height))->Red) / 255;
-	float value_u = float(bumpmap(int(u * width + 1) % width, int(v * height))->Red) / 255;
-	float value_v = float(bumpmap(int(u * width), int(v * height + 1) % height)->Red) / 255;
+	// determine UV coords of the hitpoint; asin(y) is the angle above the equator
+	float horizontal = std::sqrt(trueNormal.x * trueNormal.x + trueNormal.z * trueNormal.z);
+	float u = 0.5f - fastAtan2(-trueNormal.z, -trueNormal.x) / float(2 * M_PI);
+	float v = 0.5f - fastAtan2(trueNormal.y, horizontal) / float(M_PI);
 
-	float gradient_u = value_u - value;
-	float gradient_v = value_v - value;
+	// the bumpmap holds its height gradients, so one filtered lookup gives both; the
+	// footprint converts the ray cone width to uv units around the sphere
+	float footprint = hitFootprint() / (1.41421356f * float(M_PI) * radius);
+	// while the bump map is still streaming in the sphere is drawn smooth
+	std::shared_ptr<Texture> texture = textureCache.acquire(bumpmap);
+	colour3 gradient = texture ? texture->sample(u, v, footprint) : colour3(0, 0, 0);
 
-	// get surface tangents that correspond to u and v directions
-	point3 tangent_u = glm::normalize(glm::cross(point3(0, 1, 0), trueNormal));
-	point3 tangent_v = glm::normalize(glm::cross(trueNormal, tangent_u));
+	// get surface tangents that correspond to u and v directions; the second is already unit length
+	point3 tangent_u = point3(trueNormal.z, 0, -trueNormal.x) / std::max(horizontal, 1e-6f);
+	point3 tangent_v = glm::cross(trueNormal, tangent_u);
 
 	// modify the surface normal based on the bumpmap gradient
-	n = glm::normalize(trueNormal + gradient_u * bumpDepth * tangent_u + gradient_v * bumpDepth * tangent_v);
+	n = glm::normalize(trueNormal + gradient.x * bumpDepth * tangent_u + gradient.y * bumpDepth * tangent_v);
 }
\ No newline at end of file
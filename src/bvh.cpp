@@ -1,10 +1,21 @@
 #include "bvh.h"
 #include "raymath.h"
+#include "taskpool.h"
 
 #define MAX_T 10000
 
-BVH::BVH(std::vector<Object*> objects) {
-	// create list of all objects to be put into the tree, and separate out the planes
+// the last opaque object that blocked a shadow ray towards each light, per thread;
+// neighbouring shading points usually have the same blocker so it is tested first
+static thread_local std::vector<Object*> occluderCache;
+
+// changes whenever the cached occluders may no longer block, which each thread's cache checks
+static std::atomic<unsigned> occluderGeneration(0);
+static thread_local unsigned occluderCacheGeneration = 0;
+
+BVH::BVH(std::vector<Object*> objects) : occluderCacheHits(0), occluderCacheMisses(0) {
+	clearOccluderCaches();
+
+	// separate out the planes, then build the tree from everything else
 	std::vector<Object*> objectList;
 	
 	for (int i = 0; i < objects.size(); i++) {
@@ -14,7 +25,22 @@ BVH::BVH(std::vector<Object*> objects) {
 			// planes have infinite bounding boxes so they can't be put in the tree
 			planes.push_back((Plane*)currentObject);
 		}
-		else if (currentObject->type == "mesh") {
+		else {
+			objectList.push_back(currentObject);
+		}
+	}
+
+	root = buildTree(objectList);
+}
+
+BVH_node* BVH::buildTree(std::vector<Object*> objects) {
+	// create list of all objects to be put into the tree
+	std::vector<Object*> objectList;
+
+	for (int i = 0; i < objects.size(); i++) {
+		Object* currentObject = objects[i];
+
+		if (currentObject->type == "mesh") {
 			// each triangle is inserted into the tree individually
 			Mesh* mesh = (Mesh*)currentObject;
 			for (int t = 0; t < mesh->triangles.size(); t++) {
@@ -27,11 +53,23 @@ BVH::BVH(std::vector<Object*> objects) {
 		}
 	}
 
+	if (objectList.empty())
+		return NULL;
+
 	// create the root node, then recursively split it to create the tree
 
-	root = new BVH_node(objectList);
+	BVH_node* tree = new BVH_node(objectList);
+
+	splitNode(tree);
 
-	splitNode(root);
+	return tree;
+}
+
+void BVH::insert(BVH_node* tree) {
+	// the new objects hang off a new root, beside everything that was there before
+	if (tree == NULL)
+		return;
+	root = root != NULL ? new BVH_node(root, tree) : tree;
 }
 
 void BVH::splitNode(BVH_node* node, int depth) {
@@ -65,8 +103,17 @@ void BVH::splitNode(BVH_node* node, int depth) {
 	node->left = new BVH_node(leftObjects);
 	node->right = new BVH_node(rightObjects);
 
-	splitNode(node->left, depth + 1);
-	splitNode(node->right, depth + 1);
+	// near the top the two halves are big enough to build on separate threads
+	if (depth < BVH_PARALLEL_DEPTH && node->objects.size() >= BVH_PARALLEL_OBJECTS) {
+		TaskGroup children;
+		taskPool.run([=]() { splitNode(node->left, depth + 1); }, &children);
+		splitNode(node->right, depth + 1);
+		taskPool.wait(children);
+	}
+	else {
+		splitNode(node->left, depth + 1);
+		splitNode(node->right, depth + 1);
+	}
 }
 
 Object* BVH::findNearest(point3 e, point3 d) {
@@ -86,7 +133,8 @@ Object* BVH::findNearest(point3 e, point3 d) {
 	}
 
 	// search BVH for nearest object hit (must be closer than nearest plane)
-	findRecursive(root, e, d, t_min, hitObject);
+	if (root != NULL)
+		findRecursive(root, e, d, t_min, hitObject);
 
 	return hitObject;
 }
@@ -120,12 +168,53 @@ float BVH::findRecursive(BVH_node* node, point3 e, point3 d, float t_min, Object
 	return t_min;
 }
 
-bool BVH::calcShadow(point3 point, point3 lightPos, colour3& shadow) {
+bool BVH::calcShadow(point3 point, point3 lightPos, colour3& shadow, int light) {
 	point3 direction = lightPos - point;
-	return shadowRecursive(root, point, direction, shadow);
+
+	if (testOccluderCache(light, point, direction))
+		return false;
+
+	Object* occluder = NULL;
+	bool lit = root == NULL || shadowRecursive(root, point, direction, shadow, occluder);
+
+	if (light >= 0 && occluder != NULL)
+		occluderCache[light] = occluder;
+
+	return lit;
+}
+
+void BVH::clearOccluderCaches() {
+	occluderGeneration++;
+}
+
+bool BVH::testOccluderCache(int light, point3 e, point3 d) {
+	// returns true if the ray is blocked by the cached occluder for this light
+	if (light < 0)
+		return false;
+
+	unsigned generation = occluderGeneration.load(std::memory_order_acquire);
+	if (occluderCacheGeneration != generation) {
+		occluderCache.assign(occluderCache.size(), NULL);
+		occluderCacheGeneration = generation;
+	}
+
+	if (light >= occluderCache.size())
+		occluderCache.resize(light + 1, NULL);
+
+	Object* occluder = occluderCache[light];
+	if (occluder != NULL) {
+		float t = occluder->rayhit(e, d);
+		if (t < 1.0 && t * glm::length(d) > 1e-5) {
+			occluderCacheHits.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	occluderCacheMisses.fetch_add(1, std::memory_order_relaxed);
+	return false;
 }
 
-bool BVH::shadowRecursive(BVH_node* node, point3 e, point3 d, colour3& shadow) {
+bool BVH::shadowRecursive(BVH_node* node, point3 e, point3 d, colour3& shadow, Object*& occluder) {
 	// the key concept here is to stop testing for intersections as soon as we
 	// know the point is in shadow
 	float t = node->boundingBox.intersect(e, d);
@@ -135,9 +224,9 @@ bool BVH::shadowRecursive(BVH_node* node, point3 e, point3 d, colour3& shadow) {
 
 	if (node->left != NULL) {
 		// continue into tree
-		if (shadowRecursive(node->left, e, d, shadow) == false)
+		if (shadowRecursive(node->left, e, d, shadow, occluder) == false)
 			return false;
-		if (shadowRecursive(node->right, e, d, shadow) == false)
+		if (shadowRecursive(node->right, e, d, shadow, occluder) == false)
 			return false;
 	}
 	else {
@@ -151,14 +240,96 @@ bool BVH::shadowRecursive(BVH_node* node, point3 e, point3 d, colour3& shadow) {
 				if (!isZero(material.transmissive)) {
 					shadow *= material.transmissive;
 				}
-				else
+				else {
+					occluder = object;
 					return false;
+				}
 			}
 		}
 	}
 	return true;
 }
 
+void BVH::calcShadows(point3 point, std::vector<ShadowRay>& rays) {
+	// all rays share the same origin, so instead of walking the tree once per ray
+	// they walk it together, each ray dropping out of the batch as soon as it is blocked
+	point3 d[SHADOW_BATCH_SIZE];
+	float length[SHADOW_BATCH_SIZE];
+
+	for (int first = 0; first < rays.size(); first += SHADOW_BATCH_SIZE) {
+		int count = std::min(int(rays.size()) - first, SHADOW_BATCH_SIZE);
+		ShadowRay* batch = &rays[first];
+
+		// rays blocked by their light's cached occluder skip the traversal entirely
+		uint64_t active = 0;
+		for (int i = 0; i < count; i++) {
+			d[i] = batch[i].lightPos - point;
+			length[i] = glm::length(d[i]);
+			if (!batch[i].deferred && !testOccluderCache(batch[i].light, point, d[i]))
+				active |= uint64_t(1) << i;
+		}
+
+		if (root != NULL)
+			active = shadowBatchRecursive(root, point, d, length, batch, count, active);
+
+		for (int i = 0; i < count; i++) {
+			if (!batch[i].deferred)
+				batch[i].lit = (active >> i) & 1;
+		}
+	}
+}
+
+uint64_t BVH::shadowBatchRecursive(BVH_node* node, point3 e, const point3* d, const float* length, ShadowRay* rays, int count, uint64_t active) {
+	// returns the active mask with the rays blocked inside this node cleared
+
+	// only rays that pass through this node's box need to go further
+	uint64_t entering = 0;
+	for (int i = 0; i < count; i++) {
+		if ((active >> i) & 1) {
+			float t = node->boundingBox.intersect(e, d[i]);
+			if (t >= 0 && t <= 1)
+				entering |= uint64_t(1) << i;
+		}
+	}
+
+	if (entering == 0)
+		return active;
+
+	uint64_t unblocked = entering;
+
+	if (node->left != NULL) {
+		// continue into tree
+		unblocked = shadowBatchRecursive(node->left, e, d, length, rays, count, unblocked);
+		if (unblocked != 0)
+			unblocked = shadowBatchRecursive(node->right, e, d, length, rays, count, unblocked);
+	}
+	else {
+		// leaf node: test objects against every ray still in the batch
+		for (int j = 0; j < node->objects.size() && unblocked != 0; j++) {
+			Object* object = node->objects[j];
+			bool transmissive = !isZero(object->material.transmissive);
+
+			for (int i = 0; i < count; i++) {
+				if (!((unblocked >> i) & 1))
+					continue;
+
+				float t = object->rayhit(e, d[i]);
+				if (t < 1.0 && t * length[i] > 1e-5) {
+					if (transmissive)
+						rays[i].shadow *= object->material.transmissive;
+					else {
+						unblocked &= ~(uint64_t(1) << i);
+						if (rays[i].light >= 0)
+							occluderCache[rays[i].light] = object;
+					}
+				}
+			}
+		}
+	}
+
+	return (active & ~entering) | unblocked;
+}
+
 BVH_node::BVH_node(std::vector<Object*> objects) {
 	// go through each object to set total bounding box for this node
 	Object* currentObject = objects[0];
@@ -182,6 +353,18 @@ BVH_node::BVH_node(std::vector<Object*> objects) {
 	right = NULL;
 }
 
+BVH_node::BVH_node(BVH_node* left, BVH_node* right) {
+	this->left = left;
+	this->right = right;
+
+	boundingBox.minX = std::min(left->boundingBox.minX, right->boundingBox.minX);
+	boundingBox.maxX = std::max(left->boundingBox.maxX, right->boundingBox.maxX);
+	boundingBox.minY = std::min(left->boundingBox.minY, right->boundingBox.minY);
+	boundingBox.maxY = std::max(left->boundingBox.maxY, right->boundingBox.maxY);
+	boundingBox.minZ = std::min(left->boundingBox.minZ, right->boundingBox.minZ);
+	boundingBox.maxZ = std::max(left->boundingBox.maxZ, right->boundingBox.maxZ);
+}
+
 bool compareX(Object* o1, Object* o2) {
 	point3 c1, c2;
 	o1->getCentroid(c1);
@@ -3,7 +3,13 @@
 
 #include "objects.h"
 
+#include <cstdint>
+#include <atomic>
+
 #define MAX_BVH_DEPTH 16
+#define BVH_PARALLEL_DEPTH 4 // levels whose subtrees are built on separate tasks
+#define BVH_PARALLEL_OBJECTS 4096 // smallest node worth handing to another task
+#define SHADOW_BATCH_SIZE 64 // rays per batched shadow traversal, one bit each in the active mask
 
 class BVH_node {
 public:
@@ -12,6 +18,7 @@ public:
 	BoundingBox boundingBox;
 	std::vector<Object*> objects;
 	BVH_node(std::vector<Object*> objects);
+	BVH_node(BVH_node* left, BVH_node* right); // an interior node over two subtrees
 	void sortObjects(int axis);
 };
 
@@ -19,13 +26,21 @@ class BVH {
 public:
 	BVH_node* root;
 	std::vector<Plane*> planes;
+	std::atomic<unsigned long long> occluderCacheHits;
+	std::atomic<unsigned long long> occluderCacheMisses;
 	BVH(std::vector<Object*> objects);
+	static BVH_node* buildTree(std::vector<Object*> objects); // NULL if there is nothing to bound
+	void insert(BVH_node* tree); // not while rays are being traced
 	Object* findNearest(point3 e, point3 d);
-	bool calcShadow(point3 point, point3 lightPos, colour3& shadow);
+	bool calcShadow(point3 point, point3 lightPos, colour3& shadow, int light = -1);
+	void calcShadows(point3 point, std::vector<ShadowRay>& rays);
+	static void clearOccluderCaches(); // every thread's, once materials or lights have changed
 private:
-	void splitNode(BVH_node* node, int depth = 0);
+	static void splitNode(BVH_node* node, int depth = 0);
 	float findRecursive(BVH_node* node, point3 e, point3 d, float t_min, Object* &hitObject);
-	bool shadowRecursive(BVH_node* node, point3 e, point3 d, colour3& shadow);
+	bool shadowRecursive(BVH_node* node, point3 e, point3 d, colour3& shadow, Object*& occluder);
+	bool testOccluderCache(int light, point3 e, point3 d);
+	uint64_t shadowBatchRecursive(BVH_node* node, point3 e, const point3* d, const float* length, ShadowRay* rays, int count, uint64_t active);
 };
 
 #endif
\ No newline at end of file
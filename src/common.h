@@ -23,6 +23,7 @@ extern GLuint InitShader(const char* vShaderFile, const char* fShaderFile);
 
 extern const char *WINDOW_TITLE;
 extern const double FRAME_RATE_MS;
+extern double time_budget; // seconds each still frame may take, 0 for no limit
 
 extern void init(char *fn);
 extern void update(void);
@@ -1,4 +1,5 @@
 #include "csg.h"
+#include "raytracer.h"
 
 csgObject::csgObject(Material material) {
 	this->material = material;
@@ -29,6 +30,16 @@ void csgObject::getNormal(point3& n) {
 	n = cachedHitNormal;
 }
 
+void csgObject::saveHit(PrimaryHit& hit) {
+	hit.position = cachedHitpoint;
+	hit.normal = cachedHitNormal;
+}
+
+void csgObject::restoreHit(const PrimaryHit& hit) {
+	cachedHitpoint = hit.position;
+	cachedHitNormal = hit.normal;
+}
+
 void csgObject::getCentroid(point3& c) {
 	c.x = (boundingBox.minX + boundingBox.maxX) / 2;
 	c.y = (boundingBox.minY + boundingBox.maxY) / 2;
@@ -33,6 +33,8 @@ public:
 	float rayhit(point3 e, point3 d, bool exit);
 	void getNormal(point3& n);
 	void getCentroid(point3& c);
+	void saveHit(PrimaryHit& hit);
+	void restoreHit(const PrimaryHit& hit);
 	void setBox();
 };
 
@@ -0,0 +1,118 @@
+#include "denoise.h"
+#include "taskpool.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define DENOISE_BAND 16 // rows filtered by each task
+
+// B3 spline, the wavelet's smoothing kernel
+static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+// Change in depth per pixel across the screen at each pixel, from its neighbours on the
+// same side of any silhouette, so sloping surfaces aren't taken for edges.
+static void depthGradients(const std::vector<DenoiseFeature>& features, int width, int height, std::vector<glm::vec2>& gradients) {
+	gradients.assign(width * height, glm::vec2(0, 0));
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			float depth = features[y * width + x].depth;
+			if (depth == 0)
+				continue;
+
+			for (int axis = 0; axis < 2; axis++) {
+				int stride = axis == 0 ? 1 : width;
+				int position = axis == 0 ? x : y;
+				int size = axis == 0 ? width : height;
+				float before = position > 0 ? features[y * width + x - stride].depth : 0;
+				float after = position < size - 1 ? features[y * width + x + stride].depth : 0;
+
+				// the smaller difference, so a step down to another surface isn't counted
+				float slope = 0;
+				if (before > 0 && after > 0)
+					slope = std::abs(depth - before) < std::abs(after - depth) ? depth - before : after - depth;
+				else if (before > 0)
+					slope = depth - before;
+				else if (after > 0)
+					slope = after - depth;
+				gradients[y * width + x][axis] = slope;
+			}
+		}
+	}
+}
+
+// One iteration of the filter over rows [begin, end), with taps step pixels apart.
+static void filterRows(const std::vector<colour3>& in, const std::vector<DenoiseFeature>& features, const std::vector<glm::vec2>& gradients, int width, int height, int step, float colourSigma, std::vector<colour3>& out, int begin, int end) {
+	for (int y = begin; y < end; y++) {
+		for (int x = 0; x < width; x++) {
+			int p = y * width + x;
+			const DenoiseFeature& centre = features[p];
+			if (centre.depth == 0) {
+				out[p] = in[p];
+				continue;
+			}
+
+			colour3 total(0.0, 0.0, 0.0);
+			float totalWeight = 0;
+			for (int dy = -2; dy <= 2; dy++) {
+				int qy = y + dy * step;
+				if (qy < 0 || qy >= height)
+					continue;
+				for (int dx = -2; dx <= 2; dx++) {
+					int qx = x + dx * step;
+					if (qx < 0 || qx >= width)
+						continue;
+					int q = qy * width + qx;
+					const DenoiseFeature& tap = features[q];
+					if (tap.depth == 0)
+						continue;
+
+					float cosine = std::max(0.0f, glm::dot(centre.normal, tap.normal));
+					if (cosine == 0)
+						continue;
+
+					colour3 colourDifference = in[p] - in[q];
+					colour3 albedoDifference = centre.albedo - tap.albedo;
+					float expected = std::abs(gradients[p].x * dx * step + gradients[p].y * dy * step);
+					float exponent = glm::dot(colourDifference, colourDifference) / (colourSigma * colourSigma)
+						+ glm::dot(albedoDifference, albedoDifference) / (DENOISE_ALBEDO * DENOISE_ALBEDO)
+						+ std::abs(centre.depth - tap.depth) / (DENOISE_DEPTH * expected + 1e-3f * centre.depth);
+
+					float weight = kernel[dx + 2] * kernel[dy + 2] * std::pow(cosine, DENOISE_NORMAL) * std::exp(-exponent);
+					total += in[q] * weight;
+					totalWeight += weight;
+				}
+			}
+			out[p] = totalWeight > 0 ? total / totalWeight : in[p];
+		}
+	}
+}
+
+bool denoise(const std::vector<colour3>& image, const std::vector<DenoiseFeature>& features, int width, int height, std::vector<colour3>& result, const std::atomic<bool>* cancel) {
+	std::vector<glm::vec2> gradients;
+	depthGradients(features, width, height, gradients);
+
+	std::vector<colour3> in = image;
+	result.resize(image.size());
+
+	for (int i = 0; i < DENOISE_ITERATIONS; i++) {
+		int step = 1 << i;
+		float colourSigma = DENOISE_COLOUR / step;
+
+		TaskGroup group;
+		for (int begin = 0; begin < height; begin += DENOISE_BAND) {
+			int end = std::min(height, begin + DENOISE_BAND);
+			taskPool.run([&, begin, end]() {
+				if (cancel == NULL || !*cancel)
+					filterRows(in, features, gradients, width, height, step, colourSigma, result, begin, end);
+			}, &group);
+		}
+		taskPool.wait(group);
+
+		if (cancel != NULL && *cancel)
+			return false;
+		in.swap(result);
+	}
+
+	result.swap(in);
+	return true;
+}
@@ -0,0 +1,32 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <glm/glm.hpp>
+#include <atomic>
+#include <vector>
+
+typedef glm::vec3 point3;
+typedef glm::vec3 colour3;
+
+#define DENOISE_ITERATIONS 5		// the last one reaches 2^(ITERATIONS+1) pixels away
+#define DENOISE_COLOUR 0.4f			// colour difference the first iteration smooths over, halved by each after
+#define DENOISE_ALBEDO 0.1f			// albedo difference it smooths over
+#define DENOISE_NORMAL 64.0f		// power of the cosine between normals
+#define DENOISE_DEPTH 1.0f			// depth difference, in steps of the depth gradient
+
+// What a pixel's camera ray hit, written while tracing, to guide the denoiser.
+struct DenoiseFeature {
+	colour3 albedo;
+	point3 normal;
+	float depth; // 0 where the ray missed everything
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010): repeated 5x5 blurs with
+// the taps spread twice as far each time, where each tap is weighted down by how much
+// its colour, albedo, normal and depth differ from the centre pixel's. Noise on a
+// surface is smoothed away while edges, texture detail and shadow boundaries sharper
+// than the noise are kept. Pixels that missed everything are left as they are.
+// Rows are filtered in parallel on the task pool. False if cancel was set partway.
+bool denoise(const std::vector<colour3>& image, const std::vector<DenoiseFeature>& features, int width, int height, std::vector<colour3>& result, const std::atomic<bool>* cancel = NULL);
+
+#endif
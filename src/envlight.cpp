@@ -0,0 +1,145 @@
+#include "envlight.h"
+#include "raytracer.h"
+#include "raymath.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+// same mapping as BumpSphere: u goes around the y axis and v from top (+y) to bottom
+static glm::vec2 directionToUV(point3 d) {
+	float u = 0.5f - std::atan2(-d.z, -d.x) / float(2 * M_PI);
+	float v = 0.5f - std::asin(glm::clamp(d.y, -1.0f, 1.0f)) / float(M_PI);
+	return glm::vec2(u, v);
+}
+
+static point3 uvToDirection(glm::vec2 uv) {
+	float phi = (0.5f - uv.x) * float(2 * M_PI);
+	float elevation = (0.5f - uv.y) * float(M_PI);
+	return point3(-std::cos(phi) * std::cos(elevation), std::sin(elevation), -std::sin(phi) * std::cos(elevation));
+}
+
+EnvironmentLight::EnvironmentLight(colour3 colour, std::string mapfile, int numSamples) {
+	type = "environment";
+	this->colour = colour;
+	this->mapfile = mapfile;
+	this->numSamples = numSamples;
+
+	// the distribution is needed up front, so the map is loaded now rather than on first lookup
+	map = textureCache.acquire(textureCache.find(mapfile), true);
+
+	int level = 0;
+	while (level + 1 < map->levels.size() && map->levels[level].width > ENVIRONMENT_MAP_RESOLUTION)
+		level++;
+	MipLevel& mip = map->levels[level];
+	resX = mip.width;
+	resY = mip.height;
+
+	// each texel is weighted by its brightness and by the solid angle it covers, which
+	// shrinks towards the poles
+	marginalCdf.assign(resY + 1, 0);
+	conditionalCdf.assign(resY * (resX + 1), 0);
+	for (int y = 0; y < resY; y++) {
+		float solidAngle = std::cos((0.5f - (y + 0.5f) / resY) * float(M_PI));
+		float* row = &conditionalCdf[y * (resX + 1)];
+		for (int x = 0; x < resX; x++) {
+			colour3 texel = mip.fetch(x, y);
+			row[x + 1] = row[x] + (texel.r + texel.g + texel.b) / 3 * solidAngle;
+		}
+		marginalCdf[y + 1] = marginalCdf[y] + row[resX];
+	}
+
+	// a black map is sampled uniformly
+	if (marginalCdf[resY] <= 0) {
+		for (int y = 0; y < resY; y++) {
+			for (int x = 0; x < resX; x++)
+				conditionalCdf[y * (resX + 1) + x + 1] = float(x + 1);
+			marginalCdf[y + 1] = float((y + 1) * resX);
+		}
+	}
+}
+
+colour3 EnvironmentLight::lookup(point3 direction, float footprint) {
+	glm::vec2 uv = directionToUV(glm::normalize(direction));
+	return colour * map->sample(uv.x, uv.y, footprint / float(2 * M_PI));
+}
+
+void EnvironmentLight::sampleDirection(glm::vec2 u, point3& direction) {
+	// pick a row from the marginal, then a column within the row, each continuously within its bin
+	float target = u.y * marginalCdf[resY];
+	int y = int(std::upper_bound(marginalCdf.begin() + 1, marginalCdf.end(), target) - (marginalCdf.begin() + 1));
+	y = std::min(y, resY - 1);
+	float rowTotal = marginalCdf[y + 1] - marginalCdf[y];
+	float dy = rowTotal > 0 ? (target - marginalCdf[y]) / rowTotal : 0.5f;
+
+	const float* row = &conditionalCdf[y * (resX + 1)];
+	target = u.x * row[resX];
+	int x = int(std::upper_bound(row + 1, row + resX + 1, target) - (row + 1));
+	x = std::min(x, resX - 1);
+	float columnTotal = row[x + 1] - row[x];
+	float dx = columnTotal > 0 ? (target - row[x]) / columnTotal : 0.5f;
+
+	direction = uvToDirection(glm::vec2((x + dx) / resX, (y + dy) / resY));
+}
+
+float EnvironmentLight::pdf(point3 direction) {
+	glm::vec2 uv = directionToUV(direction);
+	int x = glm::clamp(int(uv.x * resX), 0, resX - 1);
+	int y = glm::clamp(int(uv.y * resY), 0, resY - 1);
+
+	const float* row = &conditionalCdf[y * (resX + 1)];
+	float uvPdf = (row[x + 1] - row[x]) / marginalCdf[resY] * resX * resY;
+
+	// the map covers 2 pi by pi, squeezed by cos(elevation) away from the equator
+	float cosElevation = std::sqrt(std::max(1 - direction.y * direction.y, 0.0f));
+	if (cosElevation <= 0)
+		return 0;
+	return uvPdf / (float(2 * M_PI * M_PI) * cosElevation);
+}
+
+int EnvironmentLight::sampleCount() {
+	return lightSampleCount(numSamples);
+}
+
+// the sample directions of the light being sampled, kept per thread so shading points don't allocate them
+static thread_local std::vector<glm::vec2> lightSamples;
+
+void EnvironmentLight::addShadowRays(point3 p, std::vector<ShadowRay>& rays) {
+	std::vector<glm::vec2>& samples = lightSamples;
+	int count = sampleCount();
+	threadSampler().generate2D(count, samples);
+	countSampledShadowRays(count);
+
+	for (int i = 0; i < count; i++) {
+		point3 direction;
+		sampleDirection(samples[i], direction);
+
+		ShadowRay ray;
+		ray.lightPos = p + float(MAX_T) * direction; // virtual position of light for use in shadow test
+		rays.push_back(ray);
+	}
+}
+
+void EnvironmentLight::shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) {
+	// the integral of cosine over the hemisphere is pi, so dividing by it makes a uniform
+	// white environment light a diffuse surface like a white ambient light does
+	float footprint = float(2 * M_PI) / resX;
+	colour3 totalColour = colour3(0.0, 0.0, 0.0);
+	int count = sampleCount();
+
+	for (int i = 0; i < count; i++) {
+		if (!rays[i].lit)
+			continue;
+
+		point3 L = glm::normalize(rays[i].lightPos - p);
+		float density = pdf(L);
+		if (density <= 0)
+			continue;
+
+		colour3 I = lookup(L, footprint) * rays[i].shadow / (density * float(M_PI));
+		addDiffuse(I, material.diffuse, N, L, totalColour);
+		addSpecular(I, material.specular, material.shininess, N, L, V, totalColour);
+	}
+	if (count > 0)
+		pointColour += totalColour / float(count);
+}
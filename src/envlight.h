@@ -0,0 +1,35 @@
+#ifndef ENVLIGHT_H
+#define ENVLIGHT_H
+
+#include "objects.h"
+#include "texturecache.h"
+
+#include <memory>
+
+#define ENVIRONMENT_MAP_RESOLUTION 256 // widest mip level the sampling distribution is built from
+
+// Light arriving from every direction, read from a latitude-longitude map. Rays that
+// miss the scene see the map instead of the background colour. For shading, directions
+// are importance sampled in proportion to the map's brightness using tabulated CDFs
+// (a marginal over rows and a conditional per row), so bright regions like the sun get
+// most of the shadow rays.
+class EnvironmentLight : public Light {
+public:
+	std::shared_ptr<Texture> map;
+	std::string mapfile;
+	int numSamples;
+	EnvironmentLight(colour3 colour, std::string mapfile, int numSamples);
+	colour3 lookup(point3 direction, float footprint); // footprint is the cone angle in radians
+	void addShadowRays(point3 p, std::vector<ShadowRay>& rays);
+	void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour);
+private:
+	int resX;
+	int resY;
+	std::vector<float> marginalCdf;		// resY + 1 running totals of the rows
+	std::vector<float> conditionalCdf;	// resX + 1 running totals for each row
+	void sampleDirection(glm::vec2 u, point3& direction);
+	float pdf(point3 direction); // per unit solid angle
+	int sampleCount(); // fewer while previewing, or to fit a time budget
+};
+
+#endif
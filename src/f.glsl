@@ -1,11 +1,11 @@
 #version 150
 
-in float u;
+in vec2 uv;
 out vec4 out_colour;
-uniform sampler1D tex_sampler;
+uniform sampler2D tex_sampler;
 
 void main() 
 { 
-  out_colour.rgb = texture( tex_sampler, u ).rgb;
+  out_colour.rgb = texture( tex_sampler, uv ).rgb;
   out_colour.a = 1;
 }
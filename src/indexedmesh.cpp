@@ -0,0 +1,281 @@
+#include "indexedmesh.h"
+#include "texturemesh.h"
+#include "raytracer.h"
+#include "raymath.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+#define MESH_BVH_STACK_SIZE 64
+
+IndexedMesh::IndexedMesh(Material material) {
+	this->material = material;
+	type = "indexedmesh";
+	vertices = NULL;
+	normals = NULL;
+	indices = NULL;
+	uvs = NULL;
+	uvIndices = NULL;
+	nodes = NULL;
+	triangleCount = 0;
+	nodeCount = 0;
+	texture = NULL;
+	cachedTriangle = 0;
+}
+
+void IndexedMesh::build(Mesh* mesh) {
+	TextureMesh* textureMesh = dynamic_cast<TextureMesh*>(mesh);
+	if (textureMesh != NULL)
+		texture = textureMesh->texture;
+
+	// vertices and uvs shared between triangles are stored once
+	std::map<std::array<float, 3>, uint32_t> vertexIndex;
+	std::map<std::array<float, 2>, uint32_t> uvIndex;
+	std::vector<uint32_t> meshIndices, meshUVIndices;
+	std::vector<BoundingBox> boxes;
+	std::vector<point3> centroids;
+
+	for (int i = 0; i < mesh->triangles.size(); i++) {
+		Triangle* triangle = mesh->triangles[i];
+		TextureTriangle* textureTriangle = dynamic_cast<TextureTriangle*>(triangle);
+
+		for (int k = 0; k < 3; k++) {
+			std::array<float, 3> key = { { triangle->points[k].x, triangle->points[k].y, triangle->points[k].z } };
+			std::map<std::array<float, 3>, uint32_t>::iterator it = vertexIndex.find(key);
+			if (it == vertexIndex.end()) {
+				it = vertexIndex.insert(std::make_pair(key, uint32_t(ownedVertices.size()))).first;
+				ownedVertices.push_back(triangle->points[k]);
+			}
+			meshIndices.push_back(it->second);
+
+			if (texture != NULL) {
+				glm::vec2 uv = textureTriangle != NULL ? textureTriangle->uvCoords[k] : glm::vec2(0, 0);
+				std::array<float, 2> uvKey = { { uv.x, uv.y } };
+				std::map<std::array<float, 2>, uint32_t>::iterator uvIt = uvIndex.find(uvKey);
+				if (uvIt == uvIndex.end()) {
+					uvIt = uvIndex.insert(std::make_pair(uvKey, uint32_t(ownedUVs.size()))).first;
+					ownedUVs.push_back(uv);
+				}
+				meshUVIndices.push_back(uvIt->second);
+			}
+		}
+
+		point3 centroid;
+		triangle->getCentroid(centroid);
+		centroids.push_back(centroid);
+		boxes.push_back(triangle->boundingBox);
+	}
+
+	// build the BVH over triangle numbers, then lay the triangles out in leaf order
+	std::vector<uint32_t> order(mesh->triangles.size());
+	for (uint32_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	if (!order.empty())
+		buildNode(order, boxes, centroids, 0, uint32_t(order.size()));
+
+	for (uint32_t i = 0; i < order.size(); i++) {
+		ownedNormals.push_back(mesh->triangles[order[i]]->normal);
+		for (int k = 0; k < 3; k++) {
+			ownedIndices.push_back(meshIndices[3 * order[i] + k]);
+			if (texture != NULL)
+				ownedUVIndices.push_back(meshUVIndices[3 * order[i] + k]);
+		}
+	}
+
+	setBuffers(ownedVertices.data(), ownedNormals.data(), ownedIndices.data(), texture != NULL ? ownedUVs.data() : NULL,
+		texture != NULL ? ownedUVIndices.data() : NULL, ownedNodes.data(), uint32_t(order.size()), uint32_t(ownedNodes.size()));
+}
+
+void IndexedMesh::buildNode(std::vector<uint32_t>& order, const std::vector<BoundingBox>& boxes, const std::vector<point3>& centroids, uint32_t begin, uint32_t end) {
+	// split at the median along the longest axis like the scene BVH, but down to small leaves
+	uint32_t index = uint32_t(ownedNodes.size());
+	ownedNodes.push_back(MeshBVHNode());
+
+	BoundingBox box = boxes[order[begin]];
+	for (uint32_t i = begin + 1; i < end; i++) {
+		const BoundingBox& other = boxes[order[i]];
+		box.minX = std::min(box.minX, other.minX);
+		box.maxX = std::max(box.maxX, other.maxX);
+		box.minY = std::min(box.minY, other.minY);
+		box.maxY = std::max(box.maxY, other.maxY);
+		box.minZ = std::min(box.minZ, other.minZ);
+		box.maxZ = std::max(box.maxZ, other.maxZ);
+	}
+	ownedNodes[index].box = box;
+
+	if (end - begin <= MESH_BVH_LEAF_SIZE) {
+		ownedNodes[index].first = begin;
+		ownedNodes[index].count = end - begin;
+		return;
+	}
+
+	float lengthX = box.maxX - box.minX;
+	float lengthY = box.maxY - box.minY;
+	float lengthZ = box.maxZ - box.minZ;
+	int axis = 2;
+	if (lengthX >= lengthY && lengthX >= lengthZ)
+		axis = 0;
+	else if (lengthY >= lengthZ)
+		axis = 1;
+
+	uint32_t middle = begin + (end - begin) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](uint32_t a, uint32_t b) {
+		return centroids[a][axis] < centroids[b][axis];
+	});
+
+	buildNode(order, boxes, centroids, begin, middle);
+	ownedNodes[index].first = uint32_t(ownedNodes.size());
+	ownedNodes[index].count = 0;
+	buildNode(order, boxes, centroids, middle, end);
+}
+
+void IndexedMesh::setBuffers(const point3* vertices, const point3* normals, const uint32_t* indices, const glm::vec2* uvs, const uint32_t* uvIndices, const MeshBVHNode* nodes, uint32_t triangleCount, uint32_t nodeCount) {
+	this->vertices = vertices;
+	this->normals = normals;
+	this->indices = indices;
+	this->uvs = uvs;
+	this->uvIndices = uvIndices;
+	this->nodes = nodes;
+	this->triangleCount = triangleCount;
+	this->nodeCount = nodeCount;
+	if (nodeCount > 0)
+		boundingBox = nodes[0].box;
+}
+
+float IndexedMesh::hitTriangle(uint32_t triangle, point3 e, point3 d, bool exit) {
+	// the same tests as Triangle::rayhit, so meshes look the same either way
+	point3 p0 = vertices[indices[3 * triangle]];
+	point3 p1 = vertices[indices[3 * triangle + 1]];
+	point3 p2 = vertices[indices[3 * triangle + 2]];
+	point3 n = exit ? -normals[triangle] : normals[triangle];
+
+	double numerator = glm::dot(n, p0 - e);
+	double denominator = glm::dot(n, d);
+	float t = float(numerator / denominator);
+
+	if (t <= 0 || numerator > 0)
+		return 0;
+
+	point3 hitpos = e + t * d;
+	if (!pointInTriangle(hitpos, p0, p1, p2, normals[triangle]))
+		return 0;
+	return t;
+}
+
+float IndexedMesh::rayhit(point3 e, point3 d, bool exit) {
+	// The scene BVH skips hits closer than 1e-5 (in t for camera rays, in distance for
+	// shadow rays) and looks for the next object, so the same must happen between the
+	// triangles of a mesh. The looser of the two is used and the scene BVH applies the other.
+	float t_near = exit ? 0 : 1e-5f * std::min(1.0f, 1.0f / glm::length(d));
+	float t_min = MAX_T;
+	uint32_t hit = 0;
+
+	uint32_t stack[MESH_BVH_STACK_SIZE];
+	int size = 0;
+	if (nodeCount > 0)
+		stack[size++] = 0;
+
+	while (size > 0) {
+		uint32_t index = stack[--size];
+		const MeshBVHNode& node = nodes[index];
+
+		BoundingBox box = node.box;
+		float t = box.intersect(e, d);
+		if (t < 0 || t > t_min)
+			continue;
+
+		if (node.count == 0) {
+			stack[size++] = node.first;
+			stack[size++] = index + 1;
+			continue;
+		}
+
+		for (uint32_t i = node.first; i < node.first + node.count; i++) {
+			t = hitTriangle(i, e, d, exit);
+			if (t > t_near && t < t_min) {
+				t_min = t;
+				hit = i;
+			}
+		}
+	}
+
+	if (t_min == MAX_T)
+		return 0;
+
+	cachedHitpoint = e + t_min * d;
+	cachedHitNormal = normals[hit];
+	cachedTriangle = hit;
+	return t_min;
+}
+
+void IndexedMesh::getNormal(point3& n) {
+	n = cachedHitNormal;
+}
+
+void IndexedMesh::saveHit(PrimaryHit& hit) {
+	hit.position = cachedHitpoint;
+	hit.normal = cachedHitNormal;
+	hit.primitive = cachedTriangle;
+}
+
+void IndexedMesh::restoreHit(const PrimaryHit& hit) {
+	cachedHitpoint = hit.position;
+	cachedHitNormal = hit.normal;
+	cachedTriangle = hit.primitive;
+}
+
+void IndexedMesh::getCentroid(point3& c) {
+	c.x = (boundingBox.minX + boundingBox.maxX) / 2;
+	c.y = (boundingBox.minY + boundingBox.maxY) / 2;
+	c.z = (boundingBox.minZ + boundingBox.maxZ) / 2;
+}
+
+void IndexedMesh::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick, colour3* albedo) {
+	if (texture == NULL || uvs == NULL) {
+		Object::lightPoint(e, d, Lights, colour, reflectionCount, pick, albedo);
+		return;
+	}
+
+	colour3 texColour;
+	getAlbedo(d, texColour);
+
+	// the material is shared by the whole mesh, so put it back afterwards
+	Material meshMaterial = material;
+	material.ambient = texColour;
+	material.diffuse = texColour;
+	Object::lightPoint(e, d, Lights, colour, reflectionCount, pick, albedo);
+	material = meshMaterial;
+}
+
+void IndexedMesh::getAlbedo(point3 d, colour3& albedo) {
+	if (texture == NULL || uvs == NULL) {
+		albedo = material.diffuse;
+		return;
+	}
+
+	// look the texture up as TextureTriangle does
+	point3 p = cachedHitpoint;
+	const uint32_t* index = indices + 3 * cachedTriangle;
+	const uint32_t* uvIndex = uvIndices + 3 * cachedTriangle;
+	point3 p0 = vertices[index[0]];
+	point3 p1 = vertices[index[1]];
+	point3 p2 = vertices[index[2]];
+	glm::vec2 uv0 = uvs[uvIndex[0]];
+	glm::vec2 uv1 = uvs[uvIndex[1]];
+	glm::vec2 uv2 = uvs[uvIndex[2]];
+
+	float area = glm::length(glm::cross(p0 - p1, p0 - p2));
+	float a0 = glm::length(glm::cross(p1 - p, p2 - p)) / area;
+	float a1 = glm::length(glm::cross(p2 - p, p0 - p)) / area;
+	float a2 = glm::length(glm::cross(p0 - p, p1 - p)) / area;
+	glm::vec2 uv = uv0 * a0 + uv1 * a1 + uv2 * a2;
+
+	float uvArea = std::abs((uv1.x - uv0.x) * (uv2.y - uv0.y) - (uv2.x - uv0.x) * (uv1.y - uv0.y));
+	float uvScale = area > 0 ? std::sqrt(uvArea / area) : 0;
+	float cosine = std::max(std::abs(glm::dot(glm::normalize(d), cachedHitNormal)), 0.1f);
+	float footprint = hitFootprint() * uvScale / std::sqrt(cosine);
+
+	std::shared_ptr<Texture> map = textureCache.acquire(texture);
+	albedo = map ? map->sample(uv[0], uv[1], footprint) : material.diffuse;
+}
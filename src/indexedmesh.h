@@ -0,0 +1,59 @@
+#ifndef INDEXEDMESH_H
+#define INDEXEDMESH_H
+
+#include "objects.h"
+#include "texturecache.h"
+
+#include <cstdint>
+
+#define MESH_BVH_LEAF_SIZE 4 // most triangles in a leaf of a mesh's own BVH
+
+// A node of a mesh's BVH, stored depth first: an interior node (count 0) has its left
+// child right after it and its right child at first; a leaf holds count triangles of
+// the mesh's triangle order starting at first.
+struct MeshBVHNode {
+	BoundingBox box;
+	uint32_t first;
+	uint32_t count;
+};
+
+// A mesh stored as flat vertex, index and BVH buffers and added to the scene BVH as a
+// single object, which it traverses its own BVH for. The buffers can either be owned or
+// point into a memory-mapped compiled scene, so a mesh costs one allocation however
+// many triangles it has. Triangles are one sided like Triangle, and if the mesh has a
+// texture it is looked up as by TextureTriangle.
+class IndexedMesh : public Object {
+public:
+	const point3* vertices;
+	const point3* normals;		// one per triangle
+	const uint32_t* indices;	// 3 per triangle, in BVH leaf order
+	const glm::vec2* uvs;		// NULL if untextured
+	const uint32_t* uvIndices;
+	const MeshBVHNode* nodes;
+	uint32_t triangleCount;
+	uint32_t nodeCount;
+	TextureCacheEntry* texture;
+	IndexedMesh(Material material);
+	void build(Mesh* mesh); // copies and indexes a mesh's triangles into owned buffers
+	void setBuffers(const point3* vertices, const point3* normals, const uint32_t* indices, const glm::vec2* uvs, const uint32_t* uvIndices, const MeshBVHNode* nodes, uint32_t triangleCount, uint32_t nodeCount);
+	float rayhit(point3 e, point3 d, bool exit);
+	void getNormal(point3& n);
+	void getCentroid(point3& c);
+	void lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick, colour3* albedo = NULL);
+	void saveHit(PrimaryHit& hit);
+	void restoreHit(const PrimaryHit& hit);
+	void getAlbedo(point3 d, colour3& albedo); // the texture colour at the last hit, seen along d
+	std::vector<point3> ownedVertices;
+	std::vector<point3> ownedNormals;
+	std::vector<uint32_t> ownedIndices;
+	std::vector<glm::vec2> ownedUVs;
+	std::vector<uint32_t> ownedUVIndices;
+	std::vector<MeshBVHNode> ownedNodes;
+private:
+	point3 cachedHitNormal;
+	uint32_t cachedTriangle;
+	float hitTriangle(uint32_t triangle, point3 e, point3 d, bool exit);
+	void buildNode(std::vector<uint32_t>& order, const std::vector<BoundingBox>& boxes, const std::vector<point3>& centroids, uint32_t begin, uint32_t end);
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "lightbvh.h"
+#include "sampler.h"
+
+#include <algorithm>
+
+bool stochasticLights = false;
+int lightSamplesPerPoint = 4;
+
+LightBVH::LightBVH(std::vector<Light*> lights) {
+	// lights without a position can't be bounded, so they are kept out of the tree
+	for (int i = 0; i < lights.size(); i++) {
+		BoundingBox box;
+		if (lights[i]->getBounds(box))
+			bounded.push_back(lights[i]);
+		else
+			unbounded.push_back(lights[i]);
+	}
+
+	root = NULL;
+	if (bounded.size() > 0) {
+		root = new LightBVH_node(bounded);
+		splitNode(root);
+	}
+}
+
+void LightBVH::splitNode(LightBVH_node* node) {
+	// split until every leaf holds a single light
+	if (node->lights.size() <= 1)
+		return;
+
+	// sort lights by position along longest axis
+
+	float lengthX = node->boundingBox.maxX - node->boundingBox.minX;
+	float lengthY = node->boundingBox.maxY - node->boundingBox.minY;
+	float lengthZ = node->boundingBox.maxZ - node->boundingBox.minZ;
+
+	if (lengthX >= lengthY && lengthX >= lengthZ) {
+		node->sortLights(0);
+	}
+	else if (lengthY >= lengthZ) {
+		node->sortLights(1);
+	}
+	else {
+		node->sortLights(2);
+	}
+
+	// split lights into two lists
+
+	std::vector<Light*> leftLights(node->lights.begin(), node->lights.begin() + node->lights.size() / 2);
+	std::vector<Light*> rightLights(node->lights.begin() + node->lights.size() / 2, node->lights.end());
+
+	node->left = new LightBVH_node(leftLights);
+	node->right = new LightBVH_node(rightLights);
+
+	splitNode(node->left);
+	splitNode(node->right);
+}
+
+void LightBVH::selectLights(point3 p, point3 N, int count, std::vector<Light*>& lights, std::vector<float>& weights) {
+	// weights scale each selected light's contribution so the expected total matches
+	// shading with every light
+	lights = unbounded;
+	weights.assign(unbounded.size(), 1.0f);
+
+	if (bounded.size() <= count) {
+		lights.insert(lights.end(), bounded.begin(), bounded.end());
+		weights.resize(lights.size(), 1.0f);
+		return;
+	}
+
+	Sampler& sampler = threadSampler();
+
+	for (int i = 0; i < count; i++) {
+		float pdf;
+		Light* light = sampleLight(p, N, sampler.next1D(), pdf);
+		lights.push_back(light);
+		weights.push_back(1.0f / (count * pdf));
+	}
+}
+
+Light* LightBVH::sampleLight(point3 p, point3 N, float u, float& pdf) {
+	// walk down the tree choosing each child in proportion to its importance,
+	// rescaling u at each step so a single random number is enough
+	LightBVH_node* node = root;
+	pdf = 1;
+
+	while (node->left != NULL) {
+		float leftImportance = node->left->importance(p, N);
+		float rightImportance = node->right->importance(p, N);
+		float total = leftImportance + rightImportance;
+		float pLeft = total > 0 ? leftImportance / total : 0.5f;
+
+		if (u < pLeft) {
+			u = u / pLeft;
+			pdf *= pLeft;
+			node = node->left;
+		}
+		else {
+			u = (u - pLeft) / (1 - pLeft);
+			pdf *= 1 - pLeft;
+			node = node->right;
+		}
+		u = std::min(u, 0.99999994f);
+	}
+
+	return node->lights[0];
+}
+
+LightBVH_node::LightBVH_node(std::vector<Light*> lights) {
+	// total power and bounding box of every light in this node
+	power = 0;
+	lights[0]->getBounds(boundingBox);
+
+	for (int i = 0; i < lights.size(); i++) {
+		BoundingBox box;
+		lights[i]->getBounds(box);
+
+		boundingBox.minX = std::min(boundingBox.minX, box.minX);
+		boundingBox.maxX = std::max(boundingBox.maxX, box.maxX);
+		boundingBox.minY = std::min(boundingBox.minY, box.minY);
+		boundingBox.maxY = std::max(boundingBox.maxY, box.maxY);
+		boundingBox.minZ = std::min(boundingBox.minZ, box.minZ);
+		boundingBox.maxZ = std::max(boundingBox.maxZ, box.maxZ);
+
+		power += lights[i]->getPower();
+	}
+
+	this->lights = lights;
+	left = NULL;
+	right = NULL;
+}
+
+float LightBVH_node::importance(point3 p, point3 N) {
+	// Lights here don't fall off with distance, so a node's importance is its power
+	// scaled by the largest N.L any point in its bounding sphere could give.
+	point3 centre((boundingBox.minX + boundingBox.maxX) / 2, (boundingBox.minY + boundingBox.maxY) / 2, (boundingBox.minZ + boundingBox.maxZ) / 2);
+	float radius = glm::length(point3(boundingBox.maxX, boundingBox.maxY, boundingBox.maxZ) - centre);
+
+	point3 toCentre = centre - p;
+	float distance = glm::length(toCentre);
+
+	float cosBound = 1;
+	if (distance > radius) {
+		float theta = acos(glm::clamp(glm::dot(N, toCentre) / distance, -1.0f, 1.0f));
+		float halfAngle = asin(radius / distance);
+		if (theta > halfAngle)
+			cosBound = cos(theta - halfAngle);
+	}
+
+	return power * std::max(cosBound, LIGHT_BVH_MIN_WEIGHT);
+}
+
+static point3 lightCentre(Light* light) {
+	BoundingBox box;
+	light->getBounds(box);
+	return point3((box.minX + box.maxX) / 2, (box.minY + box.maxY) / 2, (box.minZ + box.maxZ) / 2);
+}
+
+bool compareLightsX(Light* l1, Light* l2) {
+	return lightCentre(l1).x < lightCentre(l2).x;
+}
+bool compareLightsY(Light* l1, Light* l2) {
+	return lightCentre(l1).y < lightCentre(l2).y;
+}
+bool compareLightsZ(Light* l1, Light* l2) {
+	return lightCentre(l1).z < lightCentre(l2).z;
+}
+
+void LightBVH_node::sortLights(int axis) {
+	if (axis == 0) {
+		std::sort(lights.begin(), lights.end(), compareLightsX);
+	}
+	else if (axis == 1) {
+		std::sort(lights.begin(), lights.end(), compareLightsY);
+	}
+	else {
+		std::sort(lights.begin(), lights.end(), compareLightsZ);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef LIGHTBVH_H
+#define LIGHTBVH_H
+
+#include "objects.h"
+
+#define LIGHT_BVH_MIN_WEIGHT 0.05f // smallest orientation weight, so no light is ever impossible to pick
+
+extern bool stochasticLights;
+extern int lightSamplesPerPoint;
+
+class LightBVH_node {
+public:
+	LightBVH_node* left;
+	LightBVH_node* right;
+	BoundingBox boundingBox;
+	float power;
+	std::vector<Light*> lights;
+	LightBVH_node(std::vector<Light*> lights);
+	~LightBVH_node() { delete left; delete right; }
+	float importance(point3 p, point3 N);
+	void sortLights(int axis);
+};
+
+// Hierarchy over the lights that have a position, used to pick a few lights per
+// shading point with probability proportional to their estimated contribution.
+class LightBVH {
+public:
+	LightBVH_node* root;
+	std::vector<Light*> unbounded; // ambient and directional lights, which are always shaded
+	std::vector<Light*> bounded;
+	LightBVH(std::vector<Light*> lights);
+	~LightBVH() { delete root; }
+	void selectLights(point3 p, point3 N, int count, std::vector<Light*>& lights, std::vector<float>& weights);
+private:
+	void splitNode(LightBVH_node* node);
+	Light* sampleLight(point3 p, point3 N, float u, float& pdf);
+};
+
+#endif
@@ -2,8 +2,11 @@
 // Modified to isolate the main program and use GLM
 
  #include "common.h"
+#include "raytracer.h"
 
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 
 // Create a NULL-terminated string by reading the provided file
 static char*
@@ -107,6 +110,28 @@ timer(int unused)
 int
 main( int argc, char **argv )
 {
+   // "--budget <seconds>" after the scene gives each still frame a time budget, within which
+   // quality is chosen; it is taken out so the other options keep their places
+   for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--budget") != 0)
+         continue;
+      time_budget = i + 1 < argc ? atof(argv[i + 1]) : 0;
+      if (time_budget <= 0) {
+         std::cerr << "--budget needs a number of seconds" << std::endl;
+         exit( EXIT_FAILURE );
+      }
+      for (int j = i; j + 2 <= argc; j++)
+         argv[j] = argv[j + 2];
+      argc -= 2;
+      break;
+   }
+
+   // "compile" as the second argument writes the scene out in binary form and stops
+   if (argc > 2 && strcmp(argv[2], "compile") == 0) {
+      compile_scene(argv[1]);
+      return 0;
+   }
+
    glutInit( &argc, argv );
    glutInitDisplayMode( GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH );
    glutInitWindowSize( 512, 512 );
@@ -116,6 +141,14 @@ main( int argc, char **argv )
 
    glewInit();
 
+   // a second argument of "dom" loads the scene the old way, for comparison
+   if (argc > 2 && strcmp(argv[2], "dom") == 0)
+      streamSceneLoading = false;
+
+   // "progressive" starts drawing before meshes and textures have finished loading
+   if (argc > 2 && strcmp(argv[2], "progressive") == 0)
+      progressiveSceneLoading = true;
+
    init(argc > 1 ? argv[1] : NULL);
 
    glutDisplayFunc( display );
@@ -0,0 +1,105 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile() : data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL) {
+}
+
+bool MappedFile::open(std::string filename) {
+	close();
+
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		close();
+		return false;
+	}
+	size = size_t(fileSize.QuadPart);
+
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		close();
+		return false;
+	}
+
+	data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close() {
+	if (data != NULL)
+		UnmapViewOfFile(data);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+
+	data = NULL;
+	size = 0;
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+MappedFile::MappedFile() : data(NULL), size(0), file(-1) {
+}
+
+bool MappedFile::open(std::string filename) {
+	close();
+
+	file = ::open(filename.c_str(), O_RDONLY);
+	if (file < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0) {
+		close();
+		return false;
+	}
+	size = size_t(info.st_size);
+
+	void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (address == MAP_FAILED) {
+		close();
+		return false;
+	}
+	data = (const unsigned char*)address;
+	madvise(address, size, MADV_SEQUENTIAL);
+	return true;
+}
+
+void MappedFile::close() {
+	if (data != NULL)
+		munmap((void*)data, size);
+	if (file >= 0)
+		::close(file);
+
+	data = NULL;
+	size = 0;
+	file = -1;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	close();
+}
@@ -0,0 +1,28 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+// A read-only memory mapping of a whole file. The contents stay valid until the
+// object is closed or destroyed.
+class MappedFile {
+public:
+	const unsigned char* data;
+	size_t size;
+	MappedFile();
+	~MappedFile();
+	bool open(std::string filename);
+	void close();
+private:
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
+#endif
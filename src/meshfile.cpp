@@ -0,0 +1,560 @@
+#include "meshfile.h"
+#include "mappedfile.h"
+#include "taskpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <cstring>
+#include <thread>
+
+int MeshData::triangleCount() {
+	return int(indices.size() / 3);
+}
+
+void parallelFor(int count, std::function<void(int begin, int end)> body) {
+	int ranges = std::max(1, std::min(int(std::thread::hardware_concurrency()), count));
+	if (ranges <= 1) {
+		body(0, count);
+		return;
+	}
+
+	// on the task pool, since callers are usually pool tasks themselves; waiting runs
+	// the ranges no worker has taken yet
+	TaskGroup group;
+	for (int i = 0; i < ranges; i++) {
+		int begin = int(int64_t(count) * i / ranges);
+		int end = int(int64_t(count) * (i + 1) / ranges);
+		taskPool.run([=, &body]() { body(begin, end); }, &group);
+	}
+	taskPool.wait(group);
+}
+
+/****************************************************************************/
+
+// Text parsing. The mapped file isn't null terminated, so everything stops at end.
+
+static void skipSpaces(const char*& p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+}
+
+static bool parseInt(const char*& p, const char* end, int& value) {
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+	if (p >= end || *p < '0' || *p > '9')
+		return false;
+
+	int64_t result = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		result = result * 10 + (*p++ - '0');
+	value = int(negative ? -result : result);
+	return true;
+}
+
+static bool parseFloat(const char*& p, const char* end, float& value) {
+	skipSpaces(p, end);
+	bool negative = p < end && *p == '-';
+	if (p < end && (*p == '-' || *p == '+'))
+		p++;
+
+	// digits are gathered into an integer mantissa, then scaled once
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (mantissa < (uint64_t(1) << 59))
+			mantissa = mantissa * 10 + (*p - '0');
+		else
+			exponent++;
+		p++;
+		digits++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && *p >= '0' && *p <= '9') {
+			if (mantissa < (uint64_t(1) << 59)) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exponent--;
+			}
+			p++;
+			digits++;
+		}
+	}
+	if (digits == 0)
+		return false;
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		int e;
+		if (!parseInt(p, end, e))
+			return false;
+		exponent += e;
+	}
+
+	double result = double(mantissa);
+	if (exponent != 0)
+		result *= std::pow(10.0, exponent);
+	value = float(negative ? -result : result);
+	return true;
+}
+
+/****************************************************************************/
+
+// OBJ
+
+// A face corner's index as written; relative ones (negative in the file) count back
+// from the vertices read so far, so they need the vertex count of earlier chunks added.
+struct ObjIndex {
+	int index;
+	bool relative;
+};
+
+struct ObjChunk {
+	std::vector<point3> vertices;
+	std::vector<glm::vec2> uvs;
+	std::vector<ObjIndex> indices;
+	std::vector<ObjIndex> uvIndices;
+	bool allUVs = true;
+	int64_t badLine = -1; // byte offset of the first line that couldn't be read
+};
+
+static ObjIndex objIndex(int raw, int countSoFar) {
+	ObjIndex result;
+	result.relative = raw < 0;
+	result.index = raw < 0 ? countSoFar + raw : raw - 1;
+	return result;
+}
+
+static void parseObjChunk(const char* begin, const char* end, const char* fileStart, ObjChunk& chunk) {
+	std::vector<ObjIndex> face, faceUVs;
+
+	for (const char* line = begin; line < end;) {
+		const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+		if (lineEnd == NULL)
+			lineEnd = end;
+
+		const char* p = line;
+		skipSpaces(p, lineEnd);
+		bool ok = true;
+
+		if (lineEnd - p > 2 && p[0] == 'v' && p[1] == ' ') {
+			p += 2;
+			point3 v;
+			ok = parseFloat(p, lineEnd, v.x) && parseFloat(p, lineEnd, v.y) && parseFloat(p, lineEnd, v.z);
+			chunk.vertices.push_back(v);
+		}
+		else if (lineEnd - p > 3 && p[0] == 'v' && p[1] == 't' && p[2] == ' ') {
+			p += 3;
+			glm::vec2 uv;
+			ok = parseFloat(p, lineEnd, uv.x) && parseFloat(p, lineEnd, uv.y);
+			chunk.uvs.push_back(glm::vec2(uv.x, 1 - uv.y));
+		}
+		else if (lineEnd - p > 2 && p[0] == 'f' && p[1] == ' ') {
+			p += 2;
+			face.clear();
+			faceUVs.clear();
+			bool hasUVs = true;
+
+			// corners are v, v/vt, v//vn or v/vt/vn
+			while (true) {
+				skipSpaces(p, lineEnd);
+				if (p >= lineEnd)
+					break;
+
+				int v, vt;
+				if (!parseInt(p, lineEnd, v)) {
+					ok = false;
+					break;
+				}
+				face.push_back(objIndex(v, int(chunk.vertices.size())));
+
+				if (p < lineEnd && *p == '/') {
+					p++;
+					if (p < lineEnd && *p != '/' && parseInt(p, lineEnd, vt))
+						faceUVs.push_back(objIndex(vt, int(chunk.uvs.size())));
+					else
+						hasUVs = false;
+					if (p < lineEnd && *p == '/') {
+						p++;
+						int vn;
+						parseInt(p, lineEnd, vn);
+					}
+				}
+				else
+					hasUVs = false;
+			}
+
+			if (face.size() < 3)
+				ok = false;
+			chunk.allUVs = chunk.allUVs && hasUVs;
+
+			for (int i = 1; ok && i + 1 < face.size(); i++) {
+				chunk.indices.push_back(face[0]);
+				chunk.indices.push_back(face[i]);
+				chunk.indices.push_back(face[i + 1]);
+				if (hasUVs) {
+					chunk.uvIndices.push_back(faceUVs[0]);
+					chunk.uvIndices.push_back(faceUVs[i]);
+					chunk.uvIndices.push_back(faceUVs[i + 1]);
+				}
+			}
+		}
+		// anything else (normals, groups, materials, comments) is ignored
+
+		if (!ok && chunk.badLine < 0)
+			chunk.badLine = line - fileStart;
+		line = lineEnd + 1;
+	}
+}
+
+static bool loadOBJ(MappedFile& file, MeshData& mesh, std::string& error) {
+	const char* data = (const char*)file.data;
+	const char* end = data + file.size;
+
+	// split the file into a few chunks per thread, each starting at the beginning of a line
+	int chunkCount = int(std::min<size_t>(std::max<size_t>(file.size / MESH_FILE_CHUNK_SIZE, 1), std::max(1u, std::thread::hardware_concurrency()) * 4));
+	std::vector<const char*> starts(chunkCount + 1);
+	starts[0] = data;
+	starts[chunkCount] = end;
+	for (int i = 1; i < chunkCount; i++) {
+		const char* p = data + file.size * i / chunkCount;
+		p = std::max(p, starts[i - 1]);
+		const char* newline = (const char*)memchr(p, '\n', end - p);
+		starts[i] = newline == NULL ? end : newline + 1;
+	}
+
+	std::vector<ObjChunk> chunks(chunkCount);
+	parallelFor(chunkCount, [&](int begin, int last) {
+		for (int i = begin; i < last; i++)
+			parseObjChunk(starts[i], starts[i + 1], data, chunks[i]);
+	});
+
+	// chunks are then joined in file order, turning their indices into global ones
+	size_t vertexCount = 0, uvCount = 0, indexCount = 0;
+	bool allUVs = true;
+	for (int i = 0; i < chunkCount; i++) {
+		if (chunks[i].badLine >= 0) {
+			error = "unreadable line at byte " + std::to_string(chunks[i].badLine);
+			return false;
+		}
+		vertexCount += chunks[i].vertices.size();
+		uvCount += chunks[i].uvs.size();
+		indexCount += chunks[i].indices.size();
+		allUVs = allUVs && chunks[i].allUVs;
+	}
+
+	mesh.vertices.resize(vertexCount);
+	mesh.uvs.resize(uvCount);
+	mesh.indices.resize(indexCount);
+	mesh.uvIndices.resize(allUVs && uvCount > 0 ? indexCount : 0);
+
+	std::vector<size_t> vertexOffsets(chunkCount), uvOffsets(chunkCount), indexOffsets(chunkCount);
+	for (int i = 1; i < chunkCount; i++) {
+		vertexOffsets[i] = vertexOffsets[i - 1] + chunks[i - 1].vertices.size();
+		uvOffsets[i] = uvOffsets[i - 1] + chunks[i - 1].uvs.size();
+		indexOffsets[i] = indexOffsets[i - 1] + chunks[i - 1].indices.size();
+	}
+
+	std::vector<char> outOfRange(chunkCount, false); // not vector<bool>, whose elements share bytes
+	parallelFor(chunkCount, [&](int begin, int last) {
+		for (int i = begin; i < last; i++) {
+			ObjChunk& chunk = chunks[i];
+			std::copy(chunk.vertices.begin(), chunk.vertices.end(), mesh.vertices.begin() + vertexOffsets[i]);
+			std::copy(chunk.uvs.begin(), chunk.uvs.end(), mesh.uvs.begin() + uvOffsets[i]);
+
+			for (size_t j = 0; j < chunk.indices.size(); j++) {
+				int64_t index = chunk.indices[j].index + (chunk.indices[j].relative ? int64_t(vertexOffsets[i]) : 0);
+				if (index < 0 || index >= int64_t(vertexCount))
+					outOfRange[i] = true;
+				mesh.indices[indexOffsets[i] + j] = uint32_t(index);
+			}
+			for (size_t j = 0; j < chunk.uvIndices.size() && !mesh.uvIndices.empty(); j++) {
+				int64_t index = chunk.uvIndices[j].index + (chunk.uvIndices[j].relative ? int64_t(uvOffsets[i]) : 0);
+				if (index < 0 || index >= int64_t(uvCount))
+					outOfRange[i] = true;
+				mesh.uvIndices[indexOffsets[i] + j] = uint32_t(index);
+			}
+
+			std::vector<point3>().swap(chunk.vertices);
+			std::vector<ObjIndex>().swap(chunk.indices);
+		}
+	});
+
+	for (int i = 0; i < chunkCount; i++) {
+		if (outOfRange[i]) {
+			error = "face refers to a missing vertex";
+			return false;
+		}
+	}
+	return true;
+}
+
+/****************************************************************************/
+
+// PLY
+
+enum PlyType { PlyInt8, PlyUInt8, PlyInt16, PlyUInt16, PlyInt32, PlyUInt32, PlyFloat32, PlyFloat64, PlyUnknown };
+
+struct PlyProperty {
+	std::string name;
+	PlyType type;
+	bool list = false;
+	PlyType countType;
+};
+
+struct PlyElement {
+	std::string name;
+	size_t count;
+	std::vector<PlyProperty> properties;
+};
+
+static PlyType plyType(std::string name) {
+	if (name == "char" || name == "int8") return PlyInt8;
+	if (name == "uchar" || name == "uint8") return PlyUInt8;
+	if (name == "short" || name == "int16") return PlyInt16;
+	if (name == "ushort" || name == "uint16") return PlyUInt16;
+	if (name == "int" || name == "int32") return PlyInt32;
+	if (name == "uint" || name == "uint32") return PlyUInt32;
+	if (name == "float" || name == "float32") return PlyFloat32;
+	if (name == "double" || name == "float64") return PlyFloat64;
+	return PlyUnknown;
+}
+
+static int plySize(PlyType type) {
+	const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+	return sizes[type];
+}
+
+static double plyRead(const unsigned char* p, PlyType type, bool bigEndian) {
+	unsigned char bytes[8];
+	int size = plySize(type);
+	for (int i = 0; i < size; i++)
+		bytes[i] = bigEndian ? p[size - 1 - i] : p[i];
+
+	// assumes a little endian machine, like everything this builds for
+	switch (type) {
+	case PlyInt8: { int8_t v; memcpy(&v, bytes, 1); return v; }
+	case PlyUInt8: { uint8_t v; memcpy(&v, bytes, 1); return v; }
+	case PlyInt16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+	case PlyUInt16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+	case PlyInt32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+	case PlyUInt32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+	case PlyFloat32: { float v; memcpy(&v, bytes, 4); return v; }
+	case PlyFloat64: { double v; memcpy(&v, bytes, 8); return v; }
+	default: return 0;
+	}
+}
+
+static bool loadPLY(MappedFile& file, MeshData& mesh, std::string& error) {
+	const char* data = (const char*)file.data;
+	const char* end = data + file.size;
+
+	// the header is text, one statement per line
+	std::vector<PlyElement> elements;
+	bool bigEndian = false;
+	const char* line = data;
+	const char* body = NULL;
+
+	while (line < end && body == NULL) {
+		const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+		if (lineEnd == NULL)
+			break;
+
+		std::vector<std::string> words;
+		for (const char* p = line; p < lineEnd;) {
+			skipSpaces(p, lineEnd);
+			const char* word = p;
+			while (p < lineEnd && *p != ' ' && *p != '\t' && *p != '\r')
+				p++;
+			if (p > word)
+				words.push_back(std::string(word, p));
+		}
+
+		if (words.empty() || words[0] == "ply" || words[0] == "comment" || words[0] == "obj_info") {
+		}
+		else if (words[0] == "format" && words.size() > 1) {
+			if (words[1] == "binary_big_endian")
+				bigEndian = true;
+			else if (words[1] != "binary_little_endian") {
+				error = "only binary PLY files are supported";
+				return false;
+			}
+		}
+		else if (words[0] == "element" && words.size() > 2) {
+			PlyElement element;
+			element.name = words[1];
+			element.count = size_t(std::stoull(words[2]));
+			elements.push_back(element);
+		}
+		else if (words[0] == "property" && words.size() > 2 && !elements.empty()) {
+			PlyProperty property;
+			if (words[1] == "list" && words.size() > 4) {
+				property.list = true;
+				property.countType = plyType(words[2]);
+				property.type = plyType(words[3]);
+				property.name = words[4];
+			}
+			else {
+				property.type = plyType(words[1]);
+				property.name = words[2];
+			}
+			if (property.type == PlyUnknown || (property.list && property.countType == PlyUnknown)) {
+				error = "unknown property type in header";
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		}
+		else if (words[0] == "end_header")
+			body = lineEnd + 1;
+
+		line = lineEnd + 1;
+	}
+
+	if (body == NULL) {
+		error = "no end_header";
+		return false;
+	}
+
+	const unsigned char* p = (const unsigned char*)body;
+	const unsigned char* fileEnd = (const unsigned char*)end;
+
+	for (int e = 0; e < elements.size(); e++) {
+		PlyElement& element = elements[e];
+
+		// fixed size elements (vertices, in practice) can be decoded in parallel
+		bool fixedSize = true;
+		int stride = 0;
+		for (int i = 0; i < element.properties.size(); i++) {
+			fixedSize = fixedSize && !element.properties[i].list;
+			stride += plySize(element.properties[i].type);
+		}
+
+		if (element.name == "vertex") {
+			if (!fixedSize) {
+				error = "vertices with list properties aren't supported";
+				return false;
+			}
+			if (size_t(fileEnd - p) < element.count * stride) {
+				error = "file is truncated";
+				return false;
+			}
+
+			// offsets of the properties used, or -1
+			int offsets[5] = { -1, -1, -1, -1, -1 };
+			PlyType types[5];
+			const char* names[5][3] = { { "x", "x", "x" }, { "y", "y", "y" }, { "z", "z", "z" }, { "u", "s", "texture_u" }, { "v", "t", "texture_v" } };
+			int offset = 0;
+			for (int i = 0; i < element.properties.size(); i++) {
+				for (int k = 0; k < 5; k++) {
+					std::string& name = element.properties[i].name;
+					if (name == names[k][0] || name == names[k][1] || name == names[k][2]) {
+						offsets[k] = offset;
+						types[k] = element.properties[i].type;
+					}
+				}
+				offset += plySize(element.properties[i].type);
+			}
+			if (offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0) {
+				error = "vertices have no position";
+				return false;
+			}
+
+			bool hasUVs = offsets[3] >= 0 && offsets[4] >= 0;
+			mesh.vertices.resize(element.count);
+			mesh.uvs.resize(hasUVs ? element.count : 0);
+
+			const unsigned char* vertices = p;
+			parallelFor(int(element.count), [&](int begin, int last) {
+				for (int i = begin; i < last; i++) {
+					const unsigned char* vertex = vertices + size_t(i) * stride;
+					mesh.vertices[i] = point3(plyRead(vertex + offsets[0], types[0], bigEndian), plyRead(vertex + offsets[1], types[1], bigEndian), plyRead(vertex + offsets[2], types[2], bigEndian));
+					if (hasUVs)
+						mesh.uvs[i] = glm::vec2(plyRead(vertex + offsets[3], types[3], bigEndian), 1 - plyRead(vertex + offsets[4], types[4], bigEndian));
+				}
+			});
+			p += element.count * stride;
+		}
+		else if (fixedSize) {
+			if (size_t(fileEnd - p) < element.count * stride) {
+				error = "file is truncated";
+				return false;
+			}
+			p += element.count * stride;
+		}
+		else {
+			// lists have a count before each entry, so these are read in order
+			bool isFace = element.name == "face";
+			mesh.indices.reserve(isFace ? element.count * 3 : 0);
+			std::vector<uint32_t> face;
+
+			for (size_t n = 0; n < element.count; n++) {
+				for (int i = 0; i < element.properties.size(); i++) {
+					PlyProperty& property = element.properties[i];
+					bool indices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+
+					if (!property.list) {
+						p += plySize(property.type);
+						continue;
+					}
+					if (fileEnd - p < plySize(property.countType)) {
+						error = "file is truncated";
+						return false;
+					}
+					size_t count = size_t(plyRead(p, property.countType, bigEndian));
+					p += plySize(property.countType);
+					if (size_t(fileEnd - p) < count * plySize(property.type)) {
+						error = "file is truncated";
+						return false;
+					}
+
+					if (indices) {
+						face.resize(count);
+						for (size_t k = 0; k < count; k++)
+							face[k] = uint32_t(plyRead(p + k * plySize(property.type), property.type, bigEndian));
+						for (size_t k = 1; k + 1 < count; k++) {
+							mesh.indices.push_back(face[0]);
+							mesh.indices.push_back(face[k]);
+							mesh.indices.push_back(face[k + 1]);
+						}
+					}
+					p += count * plySize(property.type);
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < mesh.indices.size(); i++) {
+		if (mesh.indices[i] >= mesh.vertices.size()) {
+			error = "face refers to a missing vertex";
+			return false;
+		}
+	}
+
+	// uvs are per vertex, so they share the vertex indices
+	if (!mesh.uvs.empty())
+		mesh.uvIndices = mesh.indices;
+	return true;
+}
+
+/****************************************************************************/
+
+bool loadMeshFile(std::string filename, MeshData& mesh, std::string& error) {
+	MappedFile file;
+	if (!file.open(filename)) {
+		error = "unable to open file";
+		return false;
+	}
+
+	std::string extension = filename.substr(filename.find_last_of('.') + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+	if (extension == "obj")
+		return loadOBJ(file, mesh, error);
+	if (extension == "ply")
+		return loadPLY(file, mesh, error);
+
+	error = "unknown mesh format ." + extension;
+	return false;
+}
@@ -0,0 +1,32 @@
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define MESH_FILE_CHUNK_SIZE (size_t(1) << 20) // smallest piece of an OBJ file given to one thread
+
+typedef glm::vec3 point3;
+
+// Geometry read from an .obj or binary .ply file as indexed buffers. Polygons are split
+// into triangle fans. uvIndices is empty unless every face has texture coordinates;
+// uvs are flipped so that (0,0) is the top left of the image, as for TextureMesh.
+struct MeshData {
+	std::vector<point3> vertices;
+	std::vector<glm::vec2> uvs;
+	std::vector<uint32_t> indices;		// 3 per triangle, into vertices
+	std::vector<uint32_t> uvIndices;	// 3 per triangle, into uvs
+	int triangleCount();
+};
+
+// Chooses the format from the file extension. The file is memory mapped and parsed by
+// all hardware threads at once.
+bool loadMeshFile(std::string filename, MeshData& mesh, std::string& error);
+
+// Runs body over [0, count) split into contiguous ranges, one per hardware thread, on the task pool.
+void parallelFor(int count, std::function<void(int begin, int end)> body);
+
+#endif
@@ -51,7 +51,10 @@ float BoundingBox::intersect(point3 e, point3 d, bool exit) {
 
 // Object
 
-void Object::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick) {
+void Object::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick, colour3* albedo) {
+	if (albedo != NULL)
+		*albedo = material.diffuse;
+
 	point3 p = cachedHitpoint;
 	point3 V = glm::normalize(-d);
 	point3 N;
@@ -59,14 +62,14 @@ void Object::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3&
 
 	colour = colour3(0.0, 0.0, 0.0);
 
-	if (!isZero(material.reflective)) {
+	if (!isZero(material.reflective) && !previewShading) {
 		if (pick)
 			std::cout << "reflection:" << std::endl;
 		point3 R;
 		reflectRay(V, N, R);
 		bool hit = trace(p + float(1e-5) * R, p + R, colour, pick, reflectionCount + 1);
 		if (!hit)
-			colour = background_colour;
+			colour = background(R);
 
 		if (pick && !hit)
 			std::cout << "no additional objects hit" << std::endl;
@@ -74,11 +77,31 @@ void Object::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3&
 		colour = colour * material.reflective;
 	}
 
-	for (int i = 0; i < Lights.size(); i++) {
-		Lights[i]->lightPoint(p, N, V, material, colour);
+	// pick the lights to shade with (all of them, unless sampling stochastically)
+	std::vector<Light*> sampledLights;
+	std::vector<float> weights;
+	bool sampling = selectLights(p, N, sampledLights, weights);
+	const std::vector<Light*>& lights = sampling ? sampledLights : Lights;
+
+	// gather the shadow rays of every light so they can all be tested in one BVH traversal
+	std::vector<ShadowRay> rays;
+	std::vector<int> firstRay(lights.size());
+	for (int i = 0; i < lights.size(); i++) {
+		firstRay[i] = rays.size();
+		lights[i]->addShadowRays(p, rays);
+		for (int r = firstRay[i]; r < rays.size(); r++)
+			rays[r].light = lights[i]->id;
 	}
 
-	if (!isZero(material.transmissive)) {
+	shadowRays(p, rays);
+
+	for (int i = 0; i < lights.size(); i++) {
+		colour3 lightColour = colour3(0.0, 0.0, 0.0);
+		lights[i]->shadePoint(p, N, V, material, rays.data() + firstRay[i], lightColour);
+		colour += sampling ? lightColour * weights[i] : lightColour;
+	}
+
+	if (!isZero(material.transmissive) && !previewShading) {
 		if (pick)
 			std::cout << "transmission:" << std::endl;
 
@@ -92,7 +115,7 @@ void Object::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3&
 				std::cout << "exit object at {" << transmissionOrigin[0] << ", " << transmissionOrigin[1] << ", " << transmissionOrigin[2] << "}" << std::endl;
 			bool hit = trace(transmissionOrigin, transmissionOrigin + transmissionDirection, transcolour, pick, reflectionCount + 1);
 			if (!hit)
-				transcolour = background_colour;
+				transcolour = background(transmissionDirection);
 
 			if (pick && !hit)
 				std::cout << "no additional objects hit" << std::endl;
@@ -104,6 +127,15 @@ void Object::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3&
 	}
 }
 
+void Object::saveHit(PrimaryHit& hit) {
+	hit.position = cachedHitpoint;
+	getNormal(hit.normal);
+}
+
+void Object::restoreHit(const PrimaryHit& hit) {
+	cachedHitpoint = hit.position;
+}
+
 bool Object::transmitRay(point3 inPoint, point3 inVector, point3 inNormal, point3& outPoint, point3& outVector, bool pick) {
 	if (material.refraction == 0) {
 		outVector = inVector;
@@ -372,6 +404,29 @@ void Box::getCentroid(point3& c) {
 
 /****************************************************************************/
 
+// Light
+
+bool Light::getBounds(BoundingBox& box) {
+	return false;
+}
+
+float Light::getPower() {
+	// brightness of the light as seen by a fully facing surface
+	return (colour.r + colour.g + colour.b) / 3;
+}
+
+void Light::lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) {
+	// light a point with this light alone, using its own shadow rays
+	std::vector<ShadowRay> rays;
+	addShadowRays(p, rays);
+	for (int r = 0; r < rays.size(); r++)
+		rays[r].light = id;
+	shadowRays(p, rays);
+	shadePoint(p, N, V, material, rays.data(), pointColour);
+}
+
+/****************************************************************************/
+
 // Ambient
 
 Ambient::Ambient(colour3 colour) {
@@ -379,7 +434,11 @@ Ambient::Ambient(colour3 colour) {
 	type = "ambient";
 }
 
-void Ambient::lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) {
+void Ambient::addShadowRays(point3 p, std::vector<ShadowRay>& rays) {
+	// ambient light is never shadowed
+}
+
+void Ambient::shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) {
 	colour3 I = colour;
 
 	colour3 ambient = I * material.ambient;
@@ -396,13 +455,17 @@ Directional::Directional(colour3 colour, point3 direction) {
 	type = "directional";
 }
 
-void Directional::lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) {
+void Directional::addShadowRays(point3 p, std::vector<ShadowRay>& rays) {
+	ShadowRay ray;
+	ray.lightPos = p - float(MAX_T) * direction; // virtual position of light for use in shadow test
+	rays.push_back(ray);
+}
+
+void Directional::shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) {
 	point3 L = -direction;
-	point3 lightPosition = p + float(MAX_T) * L; // virtual position of light for use in shadow test
 
-	colour3 shadow = colour3(1.0, 1.0, 1.0);
-	if (shadowRay(p, lightPosition, shadow)) {
-		colour3 I = colour * shadow;
+	if (rays[0].lit) {
+		colour3 I = colour * rays[0].shadow;
 
 		addDiffuse(I, material.diffuse, N, L, pointColour);
 		addSpecular(I, material.specular, material.shininess, N, L, V, pointColour);
@@ -419,10 +482,22 @@ Point::Point(colour3 colour, point3 position) {
 	type = "point";
 }
 
-void Point::lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) {
-	colour3 shadow = colour3(1.0, 1.0, 1.0);
-	if (shadowRay(p, position, shadow)) {
-		colour3 I = colour * shadow;
+bool Point::getBounds(BoundingBox& box) {
+	box.minX = box.maxX = position.x;
+	box.minY = box.maxY = position.y;
+	box.minZ = box.maxZ = position.z;
+	return true;
+}
+
+void Point::addShadowRays(point3 p, std::vector<ShadowRay>& rays) {
+	ShadowRay ray;
+	ray.lightPos = position;
+	rays.push_back(ray);
+}
+
+void Point::shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) {
+	if (rays[0].lit) {
+		colour3 I = colour * rays[0].shadow;
 		point3 L = glm::normalize(position - p);
 
 		addDiffuse(I, material.diffuse, N, L, pointColour);
@@ -442,17 +517,39 @@ Spot::Spot(point3 colour, point3 position, point3 direction, float cutoff) {
 	type = "spot";
 }
 
-void Spot::lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) {
-	colour3 shadow = colour3(1.0, 1.0, 1.0);
-	if (shadowRay(p, position, shadow)) {
-		point3 dir = -direction;
-		point3 L = glm::normalize(position - p);
+bool Spot::inCone(point3 p) {
+	point3 L = glm::normalize(position - p);
+	return glm::dot(L, -direction) > cos(cutoff * M_PI / 180);
+}
+
+bool Spot::getBounds(BoundingBox& box) {
+	box.minX = box.maxX = position.x;
+	box.minY = box.maxY = position.y;
+	box.minZ = box.maxZ = position.z;
+	return true;
+}
 
-		if (glm::dot(L, dir) > cos(cutoff * M_PI / 180)) {
-			colour3 I = colour * shadow;
+float Spot::getPower() {
+	// only the fraction of directions inside the cone is lit
+	return Light::getPower() * (1 - cos(cutoff * M_PI / 180)) / 2;
+}
 
-			addDiffuse(I, material.diffuse, N, L, pointColour);
-			addSpecular(I, material.specular, material.shininess, N, L, V, pointColour);
-		}
+void Spot::addShadowRays(point3 p, std::vector<ShadowRay>& rays) {
+	// points outside the cone are unlit anyway, so they don't need a shadow ray
+	if (!inCone(p))
+		return;
+
+	ShadowRay ray;
+	ray.lightPos = position;
+	rays.push_back(ray);
+}
+
+void Spot::shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) {
+	if (inCone(p) && rays[0].lit) {
+		point3 L = glm::normalize(position - p);
+		colour3 I = colour * rays[0].shadow;
+
+		addDiffuse(I, material.diffuse, N, L, pointColour);
+		addSpecular(I, material.specular, material.shininess, N, L, V, pointColour);
 	}
 }
\ No newline at end of file
@@ -12,6 +12,7 @@ typedef glm::vec3 point3;
 typedef glm::vec3 colour3;
 
 class Mesh;
+struct PrimaryHit;
 
 struct BoundingBox {
 	float minX, maxX, minY, maxY, minZ, maxZ;
@@ -28,31 +29,52 @@ struct Material {
 	float refraction = 0;
 };
 
+// A shadow ray from a shading point towards one sample position on a light.
+// lit and shadow are filled in by the shadow test.
+struct ShadowRay {
+	point3 lightPos;
+	int light = -1; // id of the light the ray belongs to, for the occluder cache
+	bool deferred = false; // skipped by the shadow test, to be traced later only if needed
+	bool probe = false; // only used to decide whether the deferred rays need tracing
+	colour3 shadow = colour3(1, 1, 1);
+	bool lit = true;
+};
+
 class Light {
 public:
 	std::string type;
 	colour3 colour;
-	virtual void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour) = 0;
+	int id = -1;
+	virtual ~Light() {}
+	void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour);
+	virtual bool getBounds(BoundingBox& box); // false for lights with no position, which can't go in the light BVH
+	virtual float getPower();
+	virtual void addShadowRays(point3 p, std::vector<ShadowRay>& rays) = 0;
+	virtual void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour) = 0;
 };
 
 class Ambient : public Light {
 public:
 	Ambient(colour3 colour);
-	void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour);
+	void addShadowRays(point3 p, std::vector<ShadowRay>& rays);
+	void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour);
 };
 
 class Directional : public Light {
 public:
 	point3 direction;
 	Directional(colour3 colour, point3 direction);
-	void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour);
+	void addShadowRays(point3 p, std::vector<ShadowRay>& rays);
+	void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour);
 };
 
 class Point : public Light {
 public:
 	point3 position;
 	Point(colour3 colour, point3 position);
-	void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour);
+	bool getBounds(BoundingBox& box);
+	void addShadowRays(point3 p, std::vector<ShadowRay>& rays);
+	void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour);
 };
 
 class Spot : public Light {
@@ -61,7 +83,11 @@ public:
 	point3 direction;
 	float cutoff;
 	Spot(point3 colour, point3 position, point3 direction, float cutoff);
-	void lightPoint(point3 p, point3 N, point3 V, Material material, colour3& pointColour);
+	bool inCone(point3 p);
+	bool getBounds(BoundingBox& box);
+	float getPower();
+	void addShadowRays(point3 p, std::vector<ShadowRay>& rays);
+	void shadePoint(point3 p, point3 N, point3 V, Material material, const ShadowRay* rays, colour3& pointColour);
 };
 
 class Object {
@@ -73,8 +99,10 @@ public:
 	virtual float rayhit(point3 e, point3 d, bool exit = false) = 0;
 	virtual void getNormal(point3 &n) = 0;
 	virtual void getCentroid(point3& c) = 0;
-	virtual void lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick);
+	virtual void lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick, colour3* albedo = NULL); // albedo, if given, gets the diffuse colour lit
 	virtual bool transmitRay(point3 inPoint, point3 inVector, point3 inNormal, point3& outPoint, point3& outVector, bool pick);
+	virtual void saveHit(PrimaryHit& hit);			// the state rayhit left for lightPoint
+	virtual void restoreHit(const PrimaryHit& hit);
 };
 
 class Sphere : public Object {
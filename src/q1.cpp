@@ -2,6 +2,19 @@
 
 #include "common.h"
 #include "raytracer.h"
+#include "sampler.h"
+#include "arealight.h"
+#include "lightbvh.h"
+#include "texturecache.h"
+#include "denoise.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
 
 #include <iostream>
 #define M_PI 3.14159265358979323846264338327950288
@@ -11,17 +24,134 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 const char *WINDOW_TITLE = "Ray Tracing";
-const double FRAME_RATE_MS = 1;
+const double FRAME_RATE_MS = 16; // finished rows are drawn about 60 times a second
 
-colour3 texture[1<<16]; // big enough for a row of pixels
-point3 vertices[2]; // xy+u for start and end of line
-GLuint Window;
+glm::vec2 quad[4] = { glm::vec2(-1, -1), glm::vec2(1, -1), glm::vec2(-1, 1), glm::vec2(1, 1) }; // covers the window
+GLuint pixel_buffer; // rows on their way to the frame texture
+const colour3 clear_colour(0.7, 0.7, 0.8);
 int vp_width, vp_height;
-float drawing_y = 0;
+
+// Rows are traced on a render thread and published to the framebuffer; display() uploads
+// the rows published since it last ran to a texture covering the window. Objects cache
+// their last hit, so there is only one render thread, and anything else that traces or
+// changes the scene pauses it first.
+std::vector<colour3> framebuffer;	// vp_width colours per row
+std::vector<int> finished_rows;		// published but not yet uploaded
+bool upload_all = false;			// the whole framebuffer changed
+
+std::thread render_thread;
+std::mutex render_mutex;			// guards everything the two threads share
+std::condition_variable render_signal;
+std::atomic<bool> render_cancel(false); // checked between pixels
+bool render_paused = false;
+bool render_busy = false;			// a row is being traced
+bool render_stop = false;
+
+// In progressive mode a frame is drawn in passes. The preview passes trace one pixel in
+// each 8x8, then 4x4, then 2x2 block and fill the block with it, so a rough image shows
+// up quickly. The next pass finishes the first sample of every pixel, and the ones after
+// add a jittered sample each to the accumulation buffer, until the image stops changing.
+// Otherwise the frame is a single full quality pass, every 16th row at a time.
+bool progressive = true;
+#define PREVIEW_PASSES 3			// the first pass traces one pixel in 2^PREVIEW_PASSES square
+#define PROGRESSIVE_SAMPLES 256		// samples per pixel to stop at
+#define PROGRESSIVE_NOISE 0.001f	// mean change of the pixels that still change in a pass, to stop at
+std::vector<colour3> accumulation;	// sum of each pixel's samples
+std::vector<int> row_samples;		// samples in each row of the accumulation buffer
+int frame_pass = 0;
+int frame_row = 0;					// rows of the pass finished, in drawing order
+bool frame_done = false;
+double pass_change = 0;				// total change of the pixels in this pass
+int pass_changed = 0;				// pixels that changed in this pass
+
+// While the camera moves, each frame is a preview: one pixel in every MOTION_BLOCK square,
+// with direct lighting only. Once input has been idle for motion_idle_ms ('[' and ']'
+// change it) the frame is drawn again at full quality.
+#define MOTION_BLOCK 2
+int motion_idle_ms = 300;
+bool moving = false;
+int motion_frames = 0;				// preview frames finished while moving
+std::chrono::steady_clock::time_point motion_start, last_move, last_motion_frame;
+
+// What each pixel's camera ray hit, kept so the image can be reprojected when the camera
+// moves: the old pixels are moved to where their hit points appear in the new view, and
+// only the pixels left uncovered are traced before the rest of the frame is refined.
+std::vector<PrimaryHit> gbuffer;
+std::vector<bool> gbuffer_valid;
+
+// Where a pixel's stored hit came from its centre, through the current camera, its first
+// hit can be shaded again without tracing the camera ray: accumulation passes without
+// anti-aliasing, and frames redrawn after changing the lighting ('x' reloads the scene's
+// lights and materials), only pay for shading.
+std::vector<bool> gbuffer_exact;
+int reshaded_pixels = 0;			// in this frame, from stored hits
+enum PixelState { Untouched, Reprojected, Interpolated, Traced }; // so far in this frame, by the first sample
+std::vector<unsigned char> pixel_state;
+bool filling_holes = false;			// tracing the pixels reprojection left uncovered
+
+// Undersampling ('u' toggles it): once the preview passes have traced every UNDERSAMPLE_GRID-th
+// pixel, a pixel is only traced where the pixels of the coarser pass around it disagree on
+// the surface hit, its normal or their colour, and is interpolated from them elsewhere. Moving previews go on down to single
+// pixels this way, so edges stay sharp while smooth surfaces are barely traced.
+bool undersampling = true;
+#define UNDERSAMPLE_GRID 4
+#define UNDERSAMPLE_CONTRAST 0.05f	// largest colour channel difference between them
+#define UNDERSAMPLE_NORMAL 0.95f	// smallest cosine between their normals
+unsigned long long undersample_traced = 0;	// pixels of the moving previews traced
+unsigned long long undersample_interpolated = 0;
+
+// Denoising ('z' toggles it): a finished frame is filtered, guided by the albedo, normal
+// and depth of each pixel's first hit, so area lights need far fewer samples to look clean.
+bool denoising = false;
+bool denoise_pending = false;		// the frame is finished and waiting to be denoised
+
+// Time budget ("--budget <seconds>" on the command line): with progressive
+// refinement, each still frame stops refining when the time is up, with the best image so far.
+// The first preview pass is a pilot: the time it took and the rays it traced give the cost
+// of a sample of every pixel, and what's left of the budget decides how many samples to
+// take, corrected after each full pass by the time it actually took. When not even one full
+// quality sample fits, area and environment lights take fewer samples, then fewer
+// reflections are followed. Denoising comes after the budget.
+double time_budget = 0;				// seconds, 0 for no limit
+int budget_samples = PROGRESSIVE_SAMPLES; // samples per pixel the budget allows
+bool budget_jitter = false;			// several samples fit, so they are jittered for anti-aliasing
+std::chrono::steady_clock::time_point frame_start, frame_deadline, pass_start;
+
+// a row to trace: every block-th pixel, as the given sample of each pixel; the first
+// sample skips pixels already traced, and filling holes only traces untouched pixels
+struct RowJob {
+	int y;
+	int block;
+	int sample;
+	bool holes;
+	bool dirty;
+	bool edges;						// the anti-aliasing pass
+	bool subdivide;					// an undersampled pass
+};
+
+// rows to redraw ahead of the rest of the frame, because meshes or textures that cover
+// them have streamed in
+std::vector<bool> dirty_rows;
 
 point3 eye;
 float d = 1;
 
+// added variables for anti-aliasing
+// Without progressive refinement, anti-aliasing is adaptive: the frame is traced through
+// the pixel centres, then a second pass supersamples only the pixels that differ from a
+// neighbour in colour, depth or the object hit, AA_SAMPLES at a time while their samples
+// still disagree, up to aa_max_samples (',' and '.' change it).
+bool antialias = false;
+#define AA_SAMPLES 4
+#define AA_CONTRAST 0.1f			// largest colour channel difference to a neighbour
+#define AA_DEPTH 0.05f				// relative depth difference to a neighbour
+#define AA_VARIANCE 0.0002f			// variance of a pixel's mean brightness to stop at
+int aa_max_samples = 16;
+std::vector<glm::vec2> aa_offsets;
+std::vector<colour3> aa_centres;	// the centre samples, which edges are found in
+unsigned long long aa_samples = 0;	// extra samples traced by the anti-aliasing pass
+int aa_pixels = 0;					// pixels it supersampled
+
 // added variables for moving camera
 float rotationX, rotationY = 0;
 float move_step = 0.5;
@@ -41,10 +171,13 @@ void setFacing() {
 
 	camera_right = glm::normalize(glm::cross(point3(-sin(rotationY), 0, -cos(rotationY)), point3(0, 1, 0))) * w;
 	camera_up = glm::normalize(glm::cross(camera_right, facing)) * h;
-}
 
-// added variable for anti-aliasing
-bool antialias = false;
+	// angle between neighbouring camera rays, for texture filtering;
+	// anti-aliasing samples each cover a quarter of the pixel
+	pixelSpreadAngle = 2 * h / vp_height;
+	if (antialias)
+		pixelSpreadAngle /= 2;
+}
 
 //----------------------------------------------------------------------------
 
@@ -52,19 +185,15 @@ point3 s(int x, int y) {
 	return eye + facing + camera_right * (2 * ((x + 0.5f) / vp_width - 0.5f)) + camera_up * (2 * ((y + 0.5f) / vp_height - 0.5f));
 }
 
-point3 s_aa(int x, int y, int num) {
-	if (num == 0)
-		return eye + facing + camera_right * (2 * ((x + 0.25f) / vp_width - 0.5f)) + camera_up * (2 * ((y + 0.25f) / vp_height - 0.5f));
-	if (num == 1)
-		return eye + facing + camera_right * (2 * ((x + 0.75f) / vp_width - 0.5f)) + camera_up * (2 * ((y + 0.25f) / vp_height - 0.5f));
-	if (num == 2)
-		return eye + facing + camera_right * (2 * ((x + 0.25f) / vp_width - 0.5f)) + camera_up * (2 * ((y + 0.75f) / vp_height - 0.5f));
-	else
-		return eye + facing + camera_right * (2 * ((x + 0.75f) / vp_width - 0.5f)) + camera_up * (2 * ((y + 0.75f) / vp_height - 0.5f));
+point3 s_aa(int x, int y, glm::vec2 offset) {
+	return eye + facing + camera_right * (2 * ((x + offset.x) / vp_width - 0.5f)) + camera_up * (2 * ((y + offset.y) / vp_height - 0.5f));
 }
 
 //----------------------------------------------------------------------------
 
+void renderLoop();
+void stopRendering();
+
 // OpenGL initialization
 void init(char *fn) {
 	choose_scene(fn);
@@ -78,7 +207,7 @@ void init(char *fn) {
 	GLuint buffer;
 	glGenBuffers( 1, &buffer );
 	glBindBuffer( GL_ARRAY_BUFFER, buffer );
-	glBufferData( GL_ARRAY_BUFFER, sizeof(vertices), NULL, GL_STATIC_DRAW );
+	glBufferData( GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW );
 
 	// Load shaders and use the resulting shader program
 	GLuint program = InitShader( "v.glsl", "f.glsl" );
@@ -87,148 +216,840 @@ void init(char *fn) {
 	// set up vertex arrays
 	GLuint vPos = glGetAttribLocation( program, "vPos" );
 	glEnableVertexAttribArray( vPos );
-	glVertexAttribPointer( vPos, 3, GL_FLOAT, GL_FALSE, 0, 0 );
-
-	Window = glGetUniformLocation( program, "Window" );
+	glVertexAttribPointer( vPos, 2, GL_FLOAT, GL_FALSE, 0, 0 );
 
 	// glClearColor( background_colour[0], background_colour[1], background_colour[2], 1 );
-	glClearColor( 0.7, 0.7, 0.8, 1 );
+	glClearColor( clear_colour.r, clear_colour.g, clear_colour.b, 1 );
 
-	// set up a 1D texture for each scanline of output
+	// set up a 2D texture holding the whole image, sized in reshape(), in the same
+	// float format as the framebuffer so uploads are a plain copy, and a pixel
+	// buffer to stream rows into it without waiting for the driver
 	GLuint textureID;
 	glGenTextures( 1, &textureID );
-	glBindTexture( GL_TEXTURE_1D, textureID );
-	glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glBindTexture( GL_TEXTURE_2D, textureID );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+
+	glGenBuffers( 1, &pixel_buffer );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pixel_buffer );
+
+	render_thread = std::thread(renderLoop);
+	atexit(stopRendering);
 }
 
 //----------------------------------------------------------------------------
 
-void display( void ) {
-	// draw one scanline at a time, to each buffer; only clear when we draw the first scanline
-	// (when fract(drawing_y) == 0.0, draw one buffer, when it is 0.5 draw the other)
-	
-	if (drawing_y <= 0.5) {
-		glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+// Whether a pixel's centre sample differs enough from a neighbour's to need anti-aliasing.
+bool isEdge(int x, int y) {
+	int i = y * vp_width + x;
+	const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	float depth = gbuffer[i].object != NULL ? glm::length(gbuffer[i].position - eye) : 0;
 
-		glFlush();
-		glFinish();
-		glutSwapBuffers();
+	for (int k = 0; k < 4; k++) {
+		int nx = x + neighbours[k][0];
+		int ny = y + neighbours[k][1];
+		if (nx < 0 || nx >= vp_width || ny < 0 || ny >= vp_height)
+			continue;
+		int j = ny * vp_width + nx;
 
-		setFacing();
+		colour3 contrast = glm::abs(aa_centres[i] - aa_centres[j]);
+		if (std::max(contrast.r, std::max(contrast.g, contrast.b)) > AA_CONTRAST)
+			return true;
+		if (gbuffer[i].object != gbuffer[j].object)
+			return true;
+		if (gbuffer[i].object != NULL && std::abs(glm::length(gbuffer[j].position - eye) - depth) > AA_DEPTH * depth)
+			return true;
+	}
+	return false;
+}
+
+// Adds jittered samples to a pixel's centre sample in colour until the variance of their
+// mean brightness is small enough or aa_max_samples are taken.
+void supersample(int x, int y, colour3& colour) {
+	Sampler& sampler = threadSampler();
+	sampler.startPixel(x, y, 1);
+	sampler.generate2D(aa_max_samples - 1, aa_offsets);
+
+	colour3 total = colour;
+	float brightness = (colour.r + colour.g + colour.b) / 3;
+	float sum = brightness, squares = brightness * brightness;
+	int n = 1;
+	while (n < aa_max_samples) {
+		for (int k = 0; k < AA_SAMPLES && n < aa_max_samples; k++, n++) {
+			colour3 sample;
+			point3 target = s_aa(x, y, aa_offsets[n - 1]);
+			if (!trace(eye, target, sample, false))
+				sample = background(target - eye);
+			total += sample;
+			brightness = (sample.r + sample.g + sample.b) / 3;
+			sum += brightness;
+			squares += brightness * brightness;
+		}
+		float variance = (squares - sum * sum / n) / (n - 1);
+		if (variance / n < AA_VARIANCE)
+			break;
+	}
+
+	colour = total / float(n);
+	aa_samples += n - 1;
+	aa_pixels++;
+}
+
+// Whether pixel x of the job's row has to be traced this pass: every pixel when the row is
+// dirty, on an edge pass or taking more samples, otherwise those the earlier passes left unfinished.
+bool wanted(const RowJob& job, int x) {
+	if (job.dirty || job.edges || job.sample > 0)
+		return true;
+	int state = pixel_state[job.y * vp_width + x];
+	// pixels of the coarser passes are done with, even if they were interpolated
+	if (job.subdivide && x % (job.block * 2) == 0 && job.y % (job.block * 2) == 0)
+		return false;
+	return job.holes ? state == Untouched : state != Traced;
+}
+
+// Whether two hits are on the same surface: the triangles of a mesh are all one surface.
+bool sameSurface(Object* a, Object* b) {
+	if (a == b)
+		return true;
+	Triangle* ta = dynamic_cast<Triangle*>(a);
+	Triangle* tb = dynamic_cast<Triangle*>(b);
+	return ta != NULL && tb != NULL && ta->mesh == tb->mesh;
+}
+
+// Fills in a pixel of an undersampled pass from the pixels of the coarser pass on the
+// corners of the square around it (or the ends of the side it lies on), if they agree.
+// False if it has to be traced.
+bool interpolate(int x, int y, int block, colour3& colour, PrimaryHit& hit) {
+	int size = block * 2;
+	int x0 = x - x % size;
+	int y0 = y - y % size;
+	int x1 = x0 == x ? x : x0 + size;
+	int y1 = y0 == y ? y : y0 + size;
+	if (x1 >= vp_width || y1 >= vp_height)
+		return false;
+
+	float fx = float(x - x0) / size;
+	float fy = float(y - y0) / size;
+	int corners[4] = { y0 * vp_width + x0, y0 * vp_width + x1, y1 * vp_width + x0, y1 * vp_width + x1 };
+	float weights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+	const PrimaryHit& first = gbuffer[corners[0]];
+
+	for (int k = 0; k < 4; k++) {
+		int i = corners[k];
+		if (pixel_state[i] != Traced && pixel_state[i] != Interpolated)
+			return false;
+		if (!sameSurface(gbuffer[i].object, first.object))
+			return false;
+		if (first.object != NULL && glm::dot(gbuffer[i].normal, first.normal) < UNDERSAMPLE_NORMAL)
+			return false;
+		colour3 contrast = glm::abs(framebuffer[i] - framebuffer[corners[0]]);
+		if (std::max(contrast.r, std::max(contrast.g, contrast.b)) > UNDERSAMPLE_CONTRAST)
+			return false;
+	}
+
+	colour = colour3(0.0, 0.0, 0.0);
+	hit = first;
+	hit.position = point3(0.0, 0.0, 0.0);
+	hit.normal = point3(0.0, 0.0, 0.0);
+	for (int k = 0; k < 4; k++) {
+		colour += framebuffer[corners[k]] * weights[k];
+		hit.position += gbuffer[corners[k]].position * weights[k];
+		hit.normal += gbuffer[corners[k]].normal * weights[k];
+	}
+	if (hit.object != NULL)
+		hit.normal = glm::normalize(hit.normal);
+	return true;
+}
+
+// The current frame is held to the time budget.
+bool budgeted() {
+	return time_budget > 0 && progressive && !moving;
+}
+
+bool budgetSpent() {
+	return budgeted() && std::chrono::steady_clock::now() >= frame_deadline;
+}
+
+// Traces a row into row, and what the first samples hit into hits; false if the render
+// was cancelled partway. Pixels of undersampled passes may be interpolated instead.
+bool renderRow(const RowJob& job, std::vector<colour3>& row, std::vector<PrimaryHit>& hits, std::vector<bool>& interpolated) {
+	Sampler& sampler = threadSampler();
+	row.resize(vp_width);
+	hits.resize(vp_width);
+	interpolated.assign(vp_width, false);
+	int y = job.y;
+
+	for (int x = 0; x < vp_width; x += job.block) {
+		if (render_cancel || (!job.dirty && budgetSpent()))
+			return false;
+		if (!wanted(job, x))
+			continue;
+		sampler.startPixel(x, y, job.sample);
+
+		if (job.edges) {
+			row[x] = framebuffer[y * vp_width + x];
+			if (isEdge(x, y))
+				supersample(x, y, row[x]);
+			continue;
+		}
 
-		drawing_y += 0.5;
-
-	} else if (drawing_y >= 1.0 && drawing_y <= vp_height + 0.5) {
-		//int y = int(drawing_y) - 1;
-		// draw every 16th row, making 16 passes to fill the screen
-		int y = ((int(drawing_y) - 1) * 16 % vp_height) + (((int(drawing_y) - 1) * 16) / vp_height) * 7 % 16;
-
-		// only recalculate if this is a new scanline
-		if (drawing_y == int(drawing_y)) {
-
-			for (int x = 0; x < vp_width; x++) {
-				if (antialias) {
-					colour3 totalColour(0.0, 0.0, 0.0);
-					for (int i = 0; i < 4; i++) {
-						colour3 colour;
-						if (!trace(eye, s_aa(x, y, i), colour, false)) {
-							colour = background_colour;
-						}
-						totalColour += colour;
-					}
-					texture[x] = totalColour / 4.0f;
-				}
-				else {
-					if (!trace(eye, s(x, y), texture[x], false)) {
-						texture[x] = background_colour;
-					}
-				}
+		if (job.subdivide && interpolate(x, y, job.block, row[x], hits[x])) {
+			interpolated[x] = true;
+			if (moving)
+				undersample_interpolated++;
+			continue;
+		}
+		if (job.subdivide && moving)
+			undersample_traced++;
+
+		// progressive passes after the first jitter their samples for anti-aliasing
+		glm::vec2 offset(0.5f, 0.5f);
+		if ((antialias || budget_jitter) && job.sample > 0) {
+			sampler.generate2D(1, aa_offsets);
+			offset = aa_offsets[0];
+		}
+		point3 target = s_aa(x, y, offset);
+		int i = y * vp_width + x;
+		if (offset == glm::vec2(0.5f, 0.5f) && gbuffer_exact[i]) {
+			hits[x] = gbuffer[i];
+			reshaded_pixels++;
+			if (!shadeHit(eye, target, hits[x], row[x]))
+				row[x] = background(target - eye);
+		}
+		else if (!trace(eye, target, row[x], false, 0, &hits[x])) {
+			row[x] = background(target - eye);
+		}
+	}
+	return true;
+}
+
+// The row drawn i-th in a frame: every 16th row, making 16 passes to fill the screen.
+int frameRow(int i) {
+	return (i * 16 % vp_height) + ((i * 16) / vp_height) * 7 % 16;
+}
+
+int passBlock(int pass) {
+	if (filling_holes)
+		return 1;
+	return (progressive || moving) && pass < PREVIEW_PASSES ? 1 << (PREVIEW_PASSES - pass) : 1;
+}
+
+int passRows(int pass) {
+	int block = passBlock(pass);
+	return (vp_height + block - 1) / block;
+}
+
+// The row drawn i-th in a pass: preview passes go from the bottom up, the others fill in.
+int passRow(int pass, int i) {
+	int block = passBlock(pass);
+	return block > 1 ? i * block : frameRow(i);
+}
+
+// Chooses the samples per pixel, light samples and reflection depth that fit what is left
+// of the time budget, from the rays the pilot pass traced and the time it took. Shadow rays
+// are assumed to come from the hits at each depth alike. Call with render_mutex held.
+void planBudget() {
+	RayCounts counts;
+	takeRayCounts(counts);
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double pilot = std::chrono::duration<double>(now - frame_start).count();
+	double remaining = std::chrono::duration<double>(frame_deadline - now).count();
+
+	unsigned long long rays = 0;
+	for (int depth = 0; depth <= MAX_REFLECTIONS; depth++)
+		rays += counts.byDepth[depth];
+	if (rays == 0 || pilot <= 0)
+		return;
+
+	int block = passBlock(0);
+	double pilotPixels = double((vp_width + block - 1) / block) * ((vp_height + block - 1) / block);
+	double rayTime = pilot / (rays + counts.shadow) * (double(vp_width) * vp_height / pilotPixels);
+
+	// seconds for a sample of every pixel, following depth reflections with scale of the light samples
+	auto sampleTime = [&](int depth, float scale) {
+		unsigned long long traced = 0;
+		for (int i = 0; i <= depth; i++)
+			traced += counts.byDepth[i];
+		double share = double(traced) / rays;
+		double shadow = share * ((counts.shadow - counts.sampledShadow) + counts.sampledShadow * double(scale));
+		return (traced + shadow) * rayTime;
+	};
+
+	int depth = MAX_REFLECTIONS;
+	float scale = 1;
+	double samples = remaining / sampleTime(depth, scale);
+	if (samples < 1) {
+		// not even one full sample fits: fewer light samples first, then fewer reflections
+		while (depth > 0 && counts.byDepth[depth] == 0)
+			depth--;
+		int deepest = depth;
+		while (depth > 0 && sampleTime(depth, 0) > remaining)
+			depth--;
+		double fixed = sampleTime(depth, 0);
+		double sampled = sampleTime(depth, 1) - fixed;
+		scale = sampled > 0 ? float(glm::clamp((remaining - fixed) / sampled, 0.0, 1.0)) : 1;
+		if (depth == deepest)
+			depth = MAX_REFLECTIONS;
+		samples = 1;
+	}
+
+	lightSampleScale = scale;
+	maxReflections = depth;
+	budget_samples = std::min(PROGRESSIVE_SAMPLES, int(samples));
+	budget_jitter = budget_samples > 1;
+
+	std::cout << "Time budget: pilot pass in " << pilot << " s, " << budget_samples << " samples per pixel";
+	if (scale < 1)
+		std::cout << ", " << int(scale * 100 + 0.5f) << "% of light samples";
+	if (depth < MAX_REFLECTIONS)
+		std::cout << ", " << depth << " reflections";
+	std::cout << std::endl;
+}
+
+// Moves on from a finished pass, or ends the frame. Call with render_mutex held.
+void finishPass() {
+	// after filling holes the rest of the frame is traced over the reprojected image
+	if (filling_holes && !moving) {
+		filling_holes = false;
+		frame_pass = progressive ? PREVIEW_PASSES : 0;
+		frame_row = 0;
+		return;
+	}
+
+	// while moving, frames stop at the motion resolution, or once holes are filled, with or
+	// without progressive refinement; until then each preview pass is followed by a finer one
+	if (moving) {
+		if (filling_holes || passBlock(frame_pass) <= (undersampling ? 1 : MOTION_BLOCK)) {
+			filling_holes = false;
+			motion_frames++;
+			last_motion_frame = std::chrono::steady_clock::now();
+			frame_done = true;
+			return;
+		}
+		frame_pass++;
+		frame_row = 0;
+		return;
+	}
+
+	if (frame_pass == 0 && budgeted())
+		planBudget();
+
+	// without progressive refinement, the centres are followed by the anti-aliasing pass
+	if (!progressive && antialias && frame_pass == 0) {
+		aa_centres = framebuffer;
+		frame_pass = 1;
+		frame_row = 0;
+		return;
+	}
+
+	int samples = frame_pass - PREVIEW_PASSES + 1;
+	if (!progressive || samples == 1)
+		printRenderStats();
+	if (!progressive && antialias) {
+		int pixels = vp_width * vp_height;
+		std::cout << "Anti-aliasing: " << (pixels + aa_samples) / double(pixels) << " samples per pixel, " << aa_pixels << " of " << pixels << " pixels supersampled" << std::endl;
+	}
+
+	// each full pass corrects the plan with the time a sample of every pixel really takes
+	if (budgeted() && samples >= 1) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		double passTime = std::chrono::duration<double>(now - pass_start).count();
+		double remaining = std::chrono::duration<double>(frame_deadline - now).count();
+		if (passTime > 0)
+			budget_samples = std::min(PROGRESSIVE_SAMPLES, samples + std::max(0, int(remaining / passTime)));
+		budget_jitter = budget_jitter || budget_samples > samples;
+	}
+
+	// only the pixels that still change count, so a little noise isn't lost in a clean image
+	float change = pass_changed > 0 ? float(pass_change / pass_changed) : 0;
+	if (!progressive || (samples > 1 && change < PROGRESSIVE_NOISE) || samples >= budget_samples) {
+		if (progressive)
+			std::cout << "Converged after " << samples << " samples per pixel" << std::endl;
+		if (budgeted())
+			std::cout << "Finished in " << std::chrono::duration<float>(std::chrono::steady_clock::now() - frame_start).count() << " of " << time_budget << " s" << std::endl;
+		if (reshaded_pixels > 0)
+			std::cout << "Shaded " << reshaded_pixels << " pixels from stored first hits" << std::endl;
+		frame_done = true;
+		denoise_pending = denoising;
+		return;
+	}
+
+	frame_pass++;
+	frame_row = 0;
+	pass_change = 0;
+	pass_changed = 0;
+	pass_start = std::chrono::steady_clock::now();
+}
+
+// Picks the next row to trace: rows under streamed-in assets first, then the rest of the
+// pass. False if there is nothing to do. Call with render_mutex held.
+bool nextRow(RowJob& job) {
+	for (int y = 0; y < dirty_rows.size(); y++) {
+		if (dirty_rows[y]) {
+			RowJob dirty = { y, 1, 0, false, true, false, false };
+			job = dirty;
+			return true;
+		}
+	}
+
+	while (!frame_done) {
+		if (budgetSpent()) {
+			std::cout << "Stopped at the time budget after " << std::max(0, frame_pass - PREVIEW_PASSES) << " samples per pixel" << std::endl;
+			frame_done = true;
+			denoise_pending = denoising;
+			break;
+		}
+
+		// heights that aren't a multiple of 16 send some rows off the bottom of the screen
+		while (frame_row < passRows(frame_pass) && passRow(frame_pass, frame_row) >= vp_height)
+			frame_row++;
+
+		if (frame_row < passRows(frame_pass)) {
+			job.y = passRow(frame_pass, frame_row);
+			job.block = passBlock(frame_pass);
+			job.sample = progressive && !filling_holes ? std::max(0, frame_pass - PREVIEW_PASSES) : 0;
+			job.holes = filling_holes;
+			job.dirty = false;
+			// moving frames go through several passes without being anti-aliased
+			job.edges = !progressive && !moving && !filling_holes && frame_pass > 0;
+			job.subdivide = undersampling && !filling_holes && job.block < UNDERSAMPLE_GRID && (moving ? frame_pass <= PREVIEW_PASSES : progressive && frame_pass < PREVIEW_PASSES);
+			return true;
+		}
+		finishPass();
+	}
+	return false;
+}
+
+// Stores a traced row in the framebuffer, adding it to the accumulation buffer once the
+// preview passes are done. Call with render_mutex held.
+void publishRow(const RowJob& job, const std::vector<colour3>& row, const std::vector<PrimaryHit>& hits, const std::vector<bool>& interpolated) {
+	int y = job.y;
+	colour3* pixels = &framebuffer[y * vp_width];
+	colour3* sums = &accumulation[y * vp_width];
+
+	// the anti-aliasing pass leaves the pixels it didn't supersample as they were
+	if (job.edges) {
+		std::copy(row.begin(), row.end(), pixels);
+		finished_rows.push_back(y);
+		return;
+	}
+
+	// first samples are traced through the pixel centres, or interpolated when undersampling;
+	// interpolated hits are good enough to reproject but not to shade again
+	std::vector<bool> traced(vp_width, false);
+	if (job.sample == 0) {
+		for (int x = 0; x < vp_width; x += job.block) {
+			if (!wanted(job, x))
+				continue;
+			traced[x] = true;
+			pixel_state[y * vp_width + x] = interpolated[x] ? Interpolated : Traced;
+			gbuffer[y * vp_width + x] = hits[x];
+			gbuffer_valid[y * vp_width + x] = true;
+			gbuffer_exact[y * vp_width + x] = !interpolated[x];
+		}
+	}
+
+	if (job.block > 1) {
+		// each traced pixel stands in for its block until later passes fill it in
+		int height = std::min(job.block, vp_height - y);
+		for (int x = 0; x < vp_width; x += job.block) {
+			if (!traced[x])
+				continue;
+			int width = std::min(job.block, vp_width - x);
+			for (int by = 0; by < height; by++)
+				std::fill(pixels + by * vp_width + x, pixels + by * vp_width + x + width, row[x]);
+		}
+		for (int by = 0; by < height; by++)
+			finished_rows.push_back(y + by);
+		return;
+	}
+
+	if (job.holes) {
+		for (int x = 0; x < vp_width; x++) {
+			if (traced[x])
+				pixels[x] = row[x];
+		}
+	}
+	else if (job.sample == 0) {
+		// pixels traced earlier in the frame are already in place
+		for (int x = 0; x < vp_width; x++) {
+			if (traced[x])
+				pixels[x] = row[x];
+			sums[x] = pixels[x];
+		}
+		row_samples[y] = 1;
+	}
+	else {
+		int samples = ++row_samples[y];
+		for (int x = 0; x < vp_width; x++) {
+			sums[x] += row[x];
+			colour3 mean = sums[x] / float(samples);
+			colour3 change = glm::abs(mean - pixels[x]);
+			if (change != colour3(0.0, 0.0, 0.0)) {
+				pass_change += (change.r + change.g + change.b) / 3;
+				pass_changed++;
+			}
+			pixels[x] = mean;
+		}
+	}
+	finished_rows.push_back(y);
+}
+
+// Filters the finished frame into denoised; false if the render was cancelled partway.
+bool denoiseFrame(std::vector<colour3>& denoised) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::vector<DenoiseFeature> features(vp_width * vp_height);
+	for (int i = 0; i < features.size(); i++) {
+		const PrimaryHit& hit = gbuffer[i];
+		features[i].albedo = hit.albedo;
+		features[i].normal = hit.normal;
+		features[i].depth = gbuffer_valid[i] && hit.object != NULL ? glm::length(hit.position - eye) : 0;
+	}
+
+	if (!denoise(framebuffer, features, vp_width, vp_height, denoised, &render_cancel))
+		return false;
+	std::cout << "Denoised in " << std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count() << " s" << std::endl;
+	return true;
+}
+
+void renderLoop() {
+	std::vector<colour3> row;
+	std::vector<PrimaryHit> hits;
+	std::vector<bool> interpolated;
+	std::vector<colour3> denoised;
+	std::unique_lock<std::mutex> lock(render_mutex);
+
+	while (!render_stop) {
+		RowJob job;
+		if (render_paused || !nextRow(job)) {
+			if (render_paused || !denoise_pending) {
+				render_signal.wait(lock);
+				continue;
+			}
+
+			// the frame is finished; the accumulation buffer keeps the noisy image
+			denoise_pending = false;
+			render_busy = true;
+			lock.unlock();
+			bool finished = denoiseFrame(denoised);
+			lock.lock();
+			render_busy = false;
+			render_signal.notify_all();
+
+			if (finished) {
+				std::copy(denoised.begin(), denoised.end(), framebuffer.begin());
+				for (int y = 0; y < vp_height; y++)
+					finished_rows.push_back(y);
+			}
+			continue;
+		}
+
+		render_busy = true;
+		lock.unlock();
+		bool finished = renderRow(job, row, hits, interpolated);
+		lock.lock();
+		render_busy = false;
+		render_signal.notify_all();
+
+		// a cancelled row is picked again when rendering resumes, if it is still wanted
+		if (!finished)
+			continue;
+
+		publishRow(job, row, hits, interpolated);
+		if (job.dirty)
+			dirty_rows[job.y] = false;
+		else
+			frame_row++;
+	}
+}
+
+// Stops the render thread between pixels, so the scene, camera and settings can be changed.
+void pauseRendering() {
+	std::unique_lock<std::mutex> lock(render_mutex);
+	render_paused = true;
+	render_cancel = true;
+	while (render_busy)
+		render_signal.wait(lock);
+	render_cancel = false;
+}
+
+// Moves each pixel of the last image whose camera ray hit something to where the hit
+// point appears from the new camera, keeping the nearest where several land on one
+// pixel. False if nothing could be moved. Call with render_mutex held.
+bool reprojectFrame() {
+	int size = vp_width * vp_height;
+	std::vector<colour3> colours(size, clear_colour);
+	std::vector<PrimaryHit> hits(size);
+	std::vector<bool> valid(size, false);
+	std::vector<float> depths(size);
+	float right_length = glm::dot(camera_right, camera_right);
+	float up_length = glm::dot(camera_up, camera_up);
+	int moved = 0;
+
+	for (int i = 0; i < size; i++) {
+		if (!gbuffer_valid[i] || gbuffer[i].object == NULL)
+			continue;
+
+		// invert s(): where the point crosses the image plane
+		point3 v = gbuffer[i].position - eye;
+		float depth = glm::dot(v, facing);
+		if (depth <= 0)
+			continue;
+		point3 q = v / depth;
+		int x = int(std::floor((glm::dot(q, camera_right) / right_length / 2 + 0.5f) * vp_width));
+		int y = int(std::floor((glm::dot(q, camera_up) / up_length / 2 + 0.5f) * vp_height));
+		if (x < 0 || x >= vp_width || y < 0 || y >= vp_height)
+			continue;
+
+		int j = y * vp_width + x;
+		if (valid[j] && depths[j] <= depth)
+			continue;
+		if (!valid[j])
+			moved++;
+		colours[j] = framebuffer[i];
+		hits[j] = gbuffer[i];
+		depths[j] = depth;
+		valid[j] = true;
+	}
+
+	if (moved == 0)
+		return false;
+
+	framebuffer.swap(colours);
+	gbuffer.swap(hits);
+	gbuffer_valid.swap(valid);
+	for (int i = 0; i < size; i++)
+		pixel_state[i] = gbuffer_valid[i] ? Reprojected : Untouched;
+	return true;
+}
+
+// Lets the render thread carry on. A restart traces the frame again from the first row;
+// clearing also wipes the window first, for when the old image no longer lines up, unless
+// the camera has only moved and the old image can be reprojected instead.
+void resumeRendering(bool restart, bool clear, bool reproject = false) {
+	std::lock_guard<std::mutex> lock(render_mutex);
+	if (restart || clear) {
+		// without clearing, the image is refined from the first full sample of each pixel,
+		// unless a time budget needs the first preview pass as its pilot
+		frame_pass = progressive && !clear && time_budget == 0 ? PREVIEW_PASSES : 0;
+		frame_row = 0;
+		frame_done = false;
+		denoise_pending = false;
+		filling_holes = false;
+		pass_change = 0;
+		pass_changed = 0;
+		reshaded_pixels = 0;
+		aa_samples = 0;
+		aa_pixels = 0;
+		std::fill(pixel_state.begin(), pixel_state.end(), Untouched);
+
+		// each frame's budget is planned afresh, from full quality
+		lightSampleScale = 1;
+		maxReflections = MAX_REFLECTIONS;
+		budget_samples = PROGRESSIVE_SAMPLES;
+		budget_jitter = false;
+		RayCounts counts;
+		takeRayCounts(counts);
+		frame_start = std::chrono::steady_clock::now();
+		pass_start = frame_start;
+		frame_deadline = frame_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_budget));
+	}
+	if (clear) {
+		dirty_rows.assign(vp_height, false);
+		if (reproject)
+			gbuffer_exact.assign(gbuffer_exact.size(), false);
+		if (reproject && reprojectFrame())
+			filling_holes = true;
+		else
+			std::fill(framebuffer.begin(), framebuffer.end(), clear_colour);
+		finished_rows.clear();
+		upload_all = true;
+	}
+	render_paused = false;
+	render_signal.notify_all();
+}
+
+void stopRendering() {
+	pauseRendering();
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		render_stop = true;
+	}
+	render_signal.notify_all();
+	render_thread.join();
+}
+
+// Copies the given rows of the framebuffer to the frame texture, through the pixel buffer.
+// The buffer is given fresh storage each time, so the copy never waits for the last one.
+void uploadRows(std::vector<int>& rows) {
+	std::sort(rows.begin(), rows.end());
+	rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+	GLsizeiptr size = GLsizeiptr(vp_width) * vp_height * sizeof(colour3);
+	colour3* pixels = (colour3*)glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+	if (pixels == NULL)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		for (int i = 0; i < rows.size(); i++)
+			std::copy(framebuffer.begin() + rows[i] * vp_width, framebuffer.begin() + (rows[i] + 1) * vp_width, pixels + rows[i] * vp_width);
+	}
+	glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+
+	// neighbouring rows go up together
+	for (int i = 0; i < rows.size();) {
+		int first = rows[i];
+		int count = 1;
+		while (i + count < rows.size() && rows[i + count] == first + count)
+			count++;
+		glTexSubImage2D( GL_TEXTURE_2D, 0, 0, first, vp_width, count, GL_RGB, GL_FLOAT, (void*)(GLintptr(first) * vp_width * sizeof(colour3)) );
+		i += count;
+	}
+}
+
+// Marks the rows the boxes cover on screen for redrawing. Boxes reaching behind the
+// camera could cover any row, so they mark them all.
+void markRows(const std::vector<BoundingBox>& boxes) {
+	std::lock_guard<std::mutex> lock(render_mutex);
+	dirty_rows.resize(vp_height, false);
+
+	for (int i = 0; i < boxes.size(); i++) {
+		const BoundingBox& box = boxes[i];
+		float low = float(vp_height);
+		float high = -1;
+
+		for (int corner = 0; corner < 8; corner++) {
+			point3 p((corner & 1) ? box.maxX : box.minX, (corner & 2) ? box.maxY : box.minY, (corner & 4) ? box.maxZ : box.minZ);
+			point3 v = p - eye;
+			float depth = glm::dot(v, facing);
+			if (depth <= 0) {
+				low = 0;
+				high = float(vp_height - 1);
+				break;
 			}
 
-			// to ensure a power-of-two texture, get the next highest power of two
-			// https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
-			unsigned int v; // compute the next highest power of 2 of 32-bit v
-			v = vp_width;
-			v--;
-			v |= v >> 1;
-			v |= v >> 2;
-			v |= v >> 4;
-			v |= v >> 8;
-			v |= v >> 16;
-			v++;
-			
-			glTexImage1D( GL_TEXTURE_1D, 0, GL_RGB, v, 0, GL_RGB, GL_FLOAT, texture );
-			vertices[0] = point3(0, y, 0);
-			vertices[1] = point3(v, y, 1);
-			glBufferSubData( GL_ARRAY_BUFFER, 0, 2 * sizeof(point3), vertices);
+			// invert s(): the height of the corner on the image plane, in rows
+			float up = glm::dot(v / depth, camera_up) / glm::dot(camera_up, camera_up);
+			float row = (up / 2 + 0.5f) * vp_height - 0.5f;
+			low = std::min(low, row);
+			high = std::max(high, row);
+		}
+
+		for (int y = std::max(0, int(std::floor(low))); y <= std::min(vp_height - 1, int(std::ceil(high))); y++)
+			dirty_rows[y] = true;
+	}
+}
+
+void display( void ) {
+	// back to full quality once the camera has been still for long enough
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (moving && now - last_move >= std::chrono::milliseconds(motion_idle_ms)) {
+		pauseRendering();
+		moving = false;
+		previewShading = false;
+
+		float seconds = std::chrono::duration<float>(last_motion_frame - motion_start).count();
+		std::cout << "Moving: " << motion_frames << " frames";
+		if (seconds > 0)
+			std::cout << " in " << seconds << " s (" << motion_frames / seconds << " frames per second)";
+		if (undersample_interpolated > 0)
+			std::cout << ", " << 100.0 * undersample_interpolated / (undersample_traced + undersample_interpolated) << "% of undersampled pixels interpolated";
+		std::cout << std::endl;
+
+		resumeRendering(true, false);
+	}
+
+	// add any meshes and textures that have streamed in; the rows they cover are redrawn
+	// first, then the whole frame again for shadows and reflections
+	if (sceneUpdatesWaiting()) {
+		pauseRendering();
+		std::vector<BoundingBox> changed;
+		if (applySceneUpdates(changed)) {
+			markRows(changed);
+			gbuffer_exact.assign(gbuffer_exact.size(), false);
 		}
+		resumeRendering(true, false);
+	}
 
-		glDrawArrays( GL_LINES, 0, 2 );
-		
-		glFlush();
-		glFinish();
-		glutSwapBuffers();
-		
-		drawing_y += 0.5;
+	std::vector<int> rows;
+	if (upload_all) {
+		for (int y = 0; y < vp_height; y++)
+			rows.push_back(y);
+		upload_all = false;
 	}
+	{
+		std::lock_guard<std::mutex> lock(render_mutex);
+		rows.insert(rows.end(), finished_rows.begin(), finished_rows.end());
+		finished_rows.clear();
+	}
+	if (!rows.empty())
+		uploadRows(rows);
+
+	// present the whole image once per call
+	glDrawArrays( GL_TRIANGLE_STRIP, 0, 4 );
+	glutSwapBuffers();
 }
 
 //----------------------------------------------------------------------------
 
 void keyboard( unsigned char key, int x, int y ) {
+	// settings and the camera only change while nothing is being traced
+	pauseRendering();
+	bool restart = false;
+	bool clear = false;
+
 	switch( key ) {
 	case 033: // Escape Key
 		exit( EXIT_SUCCESS );
 		break;
 	case ' ':
-		drawing_y = 1;
+		restart = true;
 		break;
 
 	// camera controls
 	case 'w':
 		eye += facing * move_step;
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 's':
 		eye -= facing * move_step;
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'a':
 		eye -= glm::normalize(camera_right) * move_step;
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'd':
 		eye += glm::normalize(camera_right) * move_step;
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'q':
 		rotationY += rotate_step;
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'e':
 		rotationY -= rotate_step;
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'r':
 		if (rotationX < M_PI / 2) {
 			rotationX += rotate_step;
-			drawing_y = 0;
+			clear = true;
 		}
 		break;
 	case 'f':
 		if (rotationX > -M_PI / 2) {
 			rotationX -= rotate_step;
-			drawing_y = 0;
+			clear = true;
 		}
 		break;
 	case 't':
 		eye += point3(0, move_step, 0);
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'g':
 		eye += point3(0, -move_step, 0);
-		drawing_y = 0;
+		clear = true;
 		break;
 	case 'p':
 		std::cout << "camera: (" << eye.x << ", " << eye.y << ", " << eye.z << ")" << std::endl;
@@ -241,9 +1062,107 @@ void keyboard( unsigned char key, int x, int y ) {
 			std::cout << "Anti-aliasing ON" << std::endl;
 		else
 			std::cout << "Anti-aliasing OFF" << std::endl;
-		drawing_y = 0;
+		clear = true;
+		break;
+	// adaptive area light sampling toggle
+	case 'v':
+		adaptiveAreaSampling = !adaptiveAreaSampling;
+		if (adaptiveAreaSampling)
+			std::cout << "Adaptive area light sampling ON" << std::endl;
+		else
+			std::cout << "Adaptive area light sampling OFF" << std::endl;
+		clear = true;
+		break;
+	// stochastic light selection toggle
+	case 'b':
+		stochasticLights = !stochasticLights;
+		if (stochasticLights)
+			std::cout << "Light sampling ON (" << lightSamplesPerPoint << " lights per point)" << std::endl;
+		else
+			std::cout << "Light sampling OFF" << std::endl;
+		clear = true;
+		break;
+	// compare plain and compressed copies of the scene's textures
+	case 'c':
+		textureCache.benchmark();
+		break;
+	// progressive refinement toggle
+	case 'm':
+		progressive = !progressive;
+		if (progressive)
+			std::cout << "Progressive refinement ON" << std::endl;
+		else
+			std::cout << "Progressive refinement OFF" << std::endl;
+		clear = true;
+		break;
+	// how long the camera must be still before drawing at full quality
+	case '[':
+		motion_idle_ms = std::max(0, motion_idle_ms - 100);
+		std::cout << "Full quality after " << motion_idle_ms << " ms still" << std::endl;
+		break;
+	case ']':
+		motion_idle_ms += 100;
+		std::cout << "Full quality after " << motion_idle_ms << " ms still" << std::endl;
+		break;
+	// read the scene's lights and materials again, and redraw from the stored first hits
+	case 'x':
+		if (reload_lighting())
+			restart = true;
 		break;
+	// denoising toggle
+	case 'z':
+		denoising = !denoising;
+		if (denoising)
+			std::cout << "Denoising ON" << std::endl;
+		else
+			std::cout << "Denoising OFF" << std::endl;
+		restart = true;
+		break;
+	// undersampling toggle
+	case 'u':
+		undersampling = !undersampling;
+		if (undersampling)
+			std::cout << "Undersampling ON" << std::endl;
+		else
+			std::cout << "Undersampling OFF" << std::endl;
+		clear = true;
+		break;
+	// most samples the anti-aliasing pass takes in a pixel
+	case ',':
+		aa_max_samples = std::max(AA_SAMPLES, aa_max_samples / 2);
+		std::cout << "Anti-aliasing up to " << aa_max_samples << " samples per pixel" << std::endl;
+		restart = antialias && !progressive;
+		break;
+	case '.':
+		aa_max_samples = std::min(256, aa_max_samples * 2);
+		std::cout << "Anti-aliasing up to " << aa_max_samples << " samples per pixel" << std::endl;
+		restart = antialias && !progressive;
+		break;
+	// cycle through sample patterns used for anti-aliasing and area lights
+	case 'n':
+		samplerType = SamplerType((samplerType + 1) % NumSamplerTypes);
+		std::cout << "Sampler: " << samplerName(samplerType) << std::endl;
+		clear = true;
+		break;
+	}
+
+	// camera movement switches to previews until it stops
+	bool moved = clear && std::string("wasdqerftg").find(key) != std::string::npos;
+	if (moved) {
+		last_move = std::chrono::steady_clock::now();
+		if (!moving) {
+			moving = true;
+			previewShading = true;
+			motion_start = last_move;
+			motion_frames = 0;
+			undersample_traced = 0;
+			undersample_interpolated = 0;
+		}
 	}
+
+	if (clear)
+		setFacing();
+	resumeRendering(restart, clear, moved);
 }
 
 //----------------------------------------------------------------------------
@@ -253,6 +1172,7 @@ void mouse( int button, int state, int x, int y ) {
 	if ( state == GLUT_DOWN ) {
 		switch( button ) {
 		case GLUT_LEFT_BUTTON:
+			pauseRendering();
 			colour3 c;
 			point3 uvw = s(x, y);
 			std::cout << std::endl;
@@ -263,6 +1183,7 @@ void mouse( int button, int state, int x, int y ) {
 				std::cout << "MISS @ ( " << uvw.x << "," << uvw.y << "," << uvw.z << " )\n";
 			}
 			std::cout << std::endl;
+			resumeRendering(false, false);
 			break;
 		}
 	}
@@ -276,6 +1197,7 @@ void update( void ) {
 //----------------------------------------------------------------------------
 
 void reshape( int width, int height ) {
+	pauseRendering();
 	glViewport( 0, 0, width, height );
 
 	// GLfloat aspect = GLfloat(width)/height;
@@ -283,6 +1205,18 @@ void reshape( int width, int height ) {
 	// glUniformMatrix4fv( Projection, 1, GL_FALSE, glm::value_ptr(projection) );
 	vp_width = width;
 	vp_height = height;
-	glUniform2f( Window, width, height );
-	drawing_y = 0;
+	framebuffer.assign(width * height, clear_colour);
+	accumulation.assign(width * height, colour3(0.0, 0.0, 0.0));
+	gbuffer.assign(width * height, PrimaryHit());
+	gbuffer_valid.assign(width * height, false);
+	gbuffer_exact.assign(width * height, false);
+	pixel_state.assign(width * height, Untouched);
+	row_samples.assign(height, 0);
+	// with the pixel buffer bound, NULL would be an offset into it rather than no data
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGB32F, width, height, 0, GL_RGB, GL_FLOAT, NULL );
+	glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pixel_buffer );
+	glBufferData( GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(width) * height * sizeof(colour3), NULL, GL_STREAM_DRAW );
+	setFacing();
+	resumeRendering(true, true);
 }
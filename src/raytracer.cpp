@@ -8,7 +8,19 @@
 #include "bump.h"
 #include "csg.h"
 #include "arealight.h"
-
+#include "envlight.h"
+#include "lightbvh.h"
+#include "texturecache.h"
+#include "sceneloader.h"
+#include "meshfile.h"
+#include "scenefile.h"
+#include "taskpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -20,16 +32,56 @@
 using json = nlohmann::json;
 
 const char *PATH = "scenes/";
+bool streamSceneLoading = true;
+bool progressiveSceneLoading = false;
+bool previewShading = false;
+float lightSampleScale = 1;
+int maxReflections = MAX_REFLECTIONS;
 
 double fov = 60;
 colour3 background_colour(0, 0, 0);
 
+// Ray cones, a cheap form of ray differentials used to filter textures: each camera
+// ray is a cone widening by pixelSpreadAngle per unit of distance travelled.
+float pixelSpreadAngle = 0;
+static thread_local float footprint = 0; // width of the current ray's cone at its hit point
+
 json scene;
 
 std::vector<Object*> Objects;
 std::vector<Light*> Lights;
 
 BVH* bvh;
+LightBVH* lightBVH;
+EnvironmentLight* environmentLight = NULL;
+
+// Scene loading runs as tasks: meshes are built while parsing continues, the BVH is
+// built once they are all done, and textures decode in the background throughout.
+static TaskGroup geometryTasks;
+static TaskGroup lightTasks;
+static bool cameraRead = false;
+static std::vector<TextureCacheEntry*> pendingTextures;
+static int environmentSlot = -1;
+
+// The object made for each entry in the scene's objects, in file order (NULL where there
+// was none), so that reload_lighting can match materials back to them.
+static std::vector<Object*> sceneObjects;
+static std::string sceneFile;
+
+// With progressive loading, meshes and textures are handed over here as they finish
+// loading, to be added to the scene while no rays are in flight by applySceneUpdates.
+struct SceneUpdate {
+	Object* object;				// a mesh, with a tree of its triangles ready to attach to the BVH
+	BVH_node* tree;
+	TextureCacheEntry* texture;	// or a texture that has been decoded
+};
+static std::mutex sceneUpdateMutex;
+static std::vector<SceneUpdate> sceneUpdates;
+static std::atomic<int> assetsLoading(0);
+
+static std::atomic<unsigned long long> raysByDepth[MAX_REFLECTIONS + 1];
+static std::atomic<unsigned long long> shadowRayCount(0);
+static std::atomic<unsigned long long> sampledShadowRayCount(0);
 
 /****************************************************************************/
 
@@ -108,154 +160,310 @@ csg_node* create_csgNode(json& nodejson) {
 
 // additional ray functions
 
-bool shadowRay(const point3& point, const point3& lightPos, point3& shadow) {
-	return bvh->calcShadow(point, lightPos, shadow);
+bool shadowRay(const point3& point, const point3& lightPos, point3& shadow, int light) {
+	shadowRayCount.fetch_add(1, std::memory_order_relaxed);
+	return bvh->calcShadow(point, lightPos, shadow, light);
 }
 
-/****************************************************************************/
-
-void choose_scene(char const *fn) {
-	if (fn == NULL) {
-		std::cout << "Using default input file " << PATH << "c.json\n";
-		fn = "c";
+void shadowRays(const point3& point, std::vector<ShadowRay>& rays) {
+	int traced = 0;
+	for (int i = 0; i < rays.size(); i++) {
+		if (!rays[i].deferred)
+			traced++;
 	}
+	shadowRayCount.fetch_add(traced, std::memory_order_relaxed);
+	bvh->calcShadows(point, rays);
+}
 
-	std::cout << "Loading scene " << fn << std::endl;
-	
-	std::string fname = PATH + std::string(fn) + ".json";
-	std::fstream in(fname);
-	if (!in.is_open()) {
-		std::cout << "Unable to open scene file " << fname << std::endl;
-		exit(EXIT_FAILURE);
-	}
-	
-	in >> scene;
-	
-	json camera = scene["camera"];
-	// these are optional parameters (otherwise they default to the values initialized earlier)
-	if (camera.find("field") != camera.end()) {
-		fov = camera["field"];
-		std::cout << "Setting fov to " << fov << " degrees.\n";
+int lightSampleCount(int samples) {
+	if (samples <= 0)
+		return 0;
+	if (previewShading)
+		return 1;
+	return std::max(1, int(samples * lightSampleScale + 0.5f));
+}
+
+void countSampledShadowRays(int rays) {
+	sampledShadowRayCount.fetch_add(rays, std::memory_order_relaxed);
+}
+
+void takeRayCounts(RayCounts& counts) {
+	for (int i = 0; i <= MAX_REFLECTIONS; i++)
+		counts.byDepth[i] = raysByDepth[i].exchange(0);
+	counts.shadow = shadowRayCount.exchange(0);
+	counts.sampledShadow = sampledShadowRayCount.exchange(0);
+}
+
+bool selectLights(const point3& point, const point3& N, std::vector<Light*>& lights, std::vector<float>& weights) {
+	if (!stochasticLights || lightSamplesPerPoint <= 0)
+		return false;
+	lightBVH->selectLights(point, N, lightSamplesPerPoint, lights, weights);
+	return true;
+}
+
+/****************************************************************************/
+
+// Adds the triangles of an external .obj or .ply file to a mesh, building them in parallel.
+static void addMeshFile(Mesh* mesh, std::string filename, Material material, bool textured) {
+	MeshData data;
+	std::string error;
+	if (!loadMeshFile(filename, data, error)) {
+		std::cout << "Unable to load mesh " << filename << ": " << error << std::endl;
+		return;
 	}
-	if (camera.find("background") != camera.end()) {
-		background_colour = vector_to_vec3(camera["background"]);
-		std::cout << "Setting background colour to " << glm::to_string(background_colour) << std::endl;
+	if (textured && data.uvIndices.empty()) {
+		std::cout << "Mesh " << filename << " has no texture coordinates" << std::endl;
+		textured = false;
 	}
 
-	json objects = scene["objects"];
-	for (json::iterator it = objects.begin(); it != objects.end(); ++it) {
-		json &object = *it;
-
-		json materialjson = object["material"];
-		Material material;
-
-		if (materialjson.find("ambient") != materialjson.end())
-			material.ambient = vector_to_vec3(materialjson["ambient"]);
-		if (materialjson.find("diffuse") != materialjson.end())
-			material.diffuse = vector_to_vec3(materialjson["diffuse"]);
-		if (materialjson.find("specular") != materialjson.end())
-			material.specular = vector_to_vec3(materialjson["specular"]);
-		if (materialjson.find("reflective") != materialjson.end())
-			material.reflective = vector_to_vec3(materialjson["reflective"]);
-		if (materialjson.find("transmissive") != materialjson.end())
-			material.transmissive = vector_to_vec3(materialjson["transmissive"]);
-		if (materialjson.find("shininess") != materialjson.end())
-			material.shininess = float(materialjson["shininess"]);
-		if (materialjson.find("refraction") != materialjson.end())
-			material.refraction = float(materialjson["refraction"]);
-
-		if (object["type"] == "sphere") {
-			point3 center = vector_to_vec3(object["position"]);
-			float radius = float(object["radius"]);
-
-			Objects.push_back(new Sphere(center, radius, material));
-		}
+	int first = int(mesh->triangles.size());
+	mesh->triangles.resize(first + data.triangleCount());
 
-		if (object["type"] == "plane") {
-			point3 point = vector_to_vec3(object["position"]);
-			point3 normal = vector_to_vec3(object["normal"]);
+	parallelFor(data.triangleCount(), [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			point3 p0 = data.vertices[data.indices[3 * i]];
+			point3 p1 = data.vertices[data.indices[3 * i + 1]];
+			point3 p2 = data.vertices[data.indices[3 * i + 2]];
 
-			Objects.push_back(new Plane(point, normal, material));
+			if (textured) {
+				uvCoord uv0 = data.uvs[data.uvIndices[3 * i]];
+				uvCoord uv1 = data.uvs[data.uvIndices[3 * i + 1]];
+				uvCoord uv2 = data.uvs[data.uvIndices[3 * i + 2]];
+				mesh->triangles[first + i] = new TextureTriangle(mesh, p0, p1, p2, uv0, uv1, uv2, material);
+			}
+			else
+				mesh->triangles[first + i] = new Triangle(mesh, p0, p1, p2, material);
 		}
+	});
 
-		if (object["type"] == "mesh") {
-			std::vector<json> triangles = object["triangles"];
-
-			Mesh* mesh = new Mesh(material);
-
-			for (int i = 0; i < triangles.size(); i++) {
-				std::vector<json> trianglejson = triangles[i];
+	std::cout << "Loaded " << data.triangleCount() << " triangles and " << data.vertices.size() << " vertices from " << filename << std::endl;
+}
 
-				point3 p0 = vector_to_vec3(trianglejson[0]);
-				point3 p1 = vector_to_vec3(trianglejson[1]);
-				point3 p2 = vector_to_vec3(trianglejson[2]);
+static void streamIn(Object* object, BVH_node* tree, TextureCacheEntry* texture) {
+	SceneUpdate update = { object, tree, texture };
+	std::lock_guard<std::mutex> lock(sceneUpdateMutex);
+	sceneUpdates.push_back(update);
+}
 
+// Builds the triangles of a mesh on the task pool while parsing goes on: first those of
+// the flattened arrays, then those of an external file, if any. Meshes that end up
+// empty are removed once loading has finished. Loading progressively, the mesh's part
+// of the BVH is built here too and the mesh is only added to the scene once it's done.
+static void buildMesh(Mesh* mesh, std::vector<float>& triangles, std::vector<float>& uvCoords, std::string file, bool textured) {
+	std::shared_ptr<std::vector<float> > points(new std::vector<float>());
+	std::shared_ptr<std::vector<float> > uvs(new std::vector<float>());
+	points->swap(triangles);
+	uvs->swap(uvCoords);
+
+	// counted before the task can stream the mesh in
+	if (progressiveSceneLoading)
+		assetsLoading++;
+
+	taskPool.run([=]() {
+		Material material = mesh->material;
+		std::vector<float>& triangles = *points;
+		std::vector<float>& uvCoords = *uvs;
+		mesh->triangles.reserve(triangles.size() / 9);
+
+		for (int i = 0, j = 0; i + 9 <= triangles.size(); i += 9, j += 6) {
+			point3 p0 = point3(triangles[i], triangles[i + 1], triangles[i + 2]);
+			point3 p1 = point3(triangles[i + 3], triangles[i + 4], triangles[i + 5]);
+			point3 p2 = point3(triangles[i + 6], triangles[i + 7], triangles[i + 8]);
+
+			if (!textured)
 				mesh->triangles.push_back(new Triangle(mesh, p0, p1, p2, material));
+			else if (j + 6 <= uvCoords.size()) {
+				uvCoord uv0 = uvCoord(uvCoords[j], uvCoords[j + 1]);
+				uvCoord uv1 = uvCoord(uvCoords[j + 2], uvCoords[j + 3]);
+				uvCoord uv2 = uvCoord(uvCoords[j + 4], uvCoords[j + 5]);
+
+				mesh->triangles.push_back(new TextureTriangle(mesh, p0, p1, p2, uv0, uv1, uv2, material));
 			}
+		}
 
+		if (!file.empty())
+			addMeshFile(mesh, file, material, textured);
+
+		if (!mesh->triangles.empty())
 			mesh->setBox();
 
-			Objects.push_back(mesh);
-		}
+		if (progressiveSceneLoading)
+			streamIn(mesh, BVH::buildTree(std::vector<Object*>(1, mesh)), NULL);
+	}, &geometryTasks);
+}
 
-		if (object["type"] == "texturemesh") {
-			std::vector<json> triangles = object["triangles"];
-			std::vector<json> uvCoords = object["uvCoords"];
-			std::string texturefile = object["texture"];
+// Starts decoding a texture in the background, so it is usually ready by the time the
+// first ray hits it. Until the camera has been read it isn't known whether textures are
+// to be compressed, so until then they are only queued.
+static void prefetchTexture(TextureCacheEntry* entry) {
+	if (!cameraRead) {
+		pendingTextures.push_back(entry);
+		return;
+	}
 
-			TextureMesh* mesh = new TextureMesh(material, PATH + texturefile);
+	if (!progressiveSceneLoading) {
+		textureCache.prefetch(entry);
+		return;
+	}
 
-			for (int i = 0; i < triangles.size(); i++) {
-				std::vector<json> trianglejson = triangles[i];
-				std::vector<json> uvjson = uvCoords[i];
+	// counted before the texture can stream in, and uncounted if it was already loading
+	assetsLoading++;
+	if (!textureCache.prefetch(entry, [=]() { streamIn(NULL, NULL, entry); }))
+		assetsLoading--;
+}
 
-				point3 p0 = vector_to_vec3(trianglejson[0]);
-				point3 p1 = vector_to_vec3(trianglejson[1]);
-				point3 p2 = vector_to_vec3(trianglejson[2]);
+static bool usesTexture(Object* object, TextureCacheEntry* entry) {
+	TextureMesh* textureMesh = dynamic_cast<TextureMesh*>(object);
+	IndexedMesh* indexedMesh = dynamic_cast<IndexedMesh*>(object);
+	BumpSphere* bumpSphere = dynamic_cast<BumpSphere*>(object);
+	return (textureMesh != NULL && textureMesh->texture == entry) || (indexedMesh != NULL && indexedMesh->texture == entry) ||
+		(bumpSphere != NULL && bumpSphere->bumpmap == entry);
+}
 
-				uvCoord uv0 = vector_to_vec2(uvjson[0]);
-				uvCoord uv1 = vector_to_vec2(uvjson[1]);
-				uvCoord uv2 = vector_to_vec2(uvjson[2]);
+// Reads an object's "material", leaving unset fields at their defaults.
+static Material read_material(json& materialjson) {
+	Material material;
+
+	if (materialjson.find("ambient") != materialjson.end())
+		material.ambient = vector_to_vec3(materialjson["ambient"]);
+	if (materialjson.find("diffuse") != materialjson.end())
+		material.diffuse = vector_to_vec3(materialjson["diffuse"]);
+	if (materialjson.find("specular") != materialjson.end())
+		material.specular = vector_to_vec3(materialjson["specular"]);
+	if (materialjson.find("reflective") != materialjson.end())
+		material.reflective = vector_to_vec3(materialjson["reflective"]);
+	if (materialjson.find("transmissive") != materialjson.end())
+		material.transmissive = vector_to_vec3(materialjson["transmissive"]);
+	if (materialjson.find("shininess") != materialjson.end())
+		material.shininess = float(materialjson["shininess"]);
+	if (materialjson.find("refraction") != materialjson.end())
+		material.refraction = float(materialjson["refraction"]);
+	return material;
+}
 
-				mesh->triangles.push_back(new TextureTriangle(mesh, p0, p1, p2, uv0, uv1, uv2, material));
-			}
+// Builds one entry of "objects". The triangles and uvCoords of meshes come flattened,
+// 9 floats per triangle and 6 per triangle's uvs; meshes can also name an external .obj or .ply "file".
+static void addObject(json& object, std::vector<float>& triangles, std::vector<float>& uvCoords) {
+	Material material = read_material(object["material"]);
+	Object* created = NULL;
 
-			Objects.push_back(mesh);
-		}
+	if (object["type"] == "sphere") {
+		point3 center = vector_to_vec3(object["position"]);
+		float radius = float(object["radius"]);
 
-		if (object["type"] == "bumpsphere") {
-			point3 center = vector_to_vec3(object["position"]);
-			float radius = float(object["radius"]);
-			std::string bumpmapfile = object["bumpmap"];
-			float bumpDepth = object["bumpdepth"];
+		created = new Sphere(center, radius, material);
+	}
 
-			Objects.push_back(new BumpSphere(center, radius, material, PATH + bumpmapfile, bumpDepth));
-		}
+	if (object["type"] == "plane") {
+		point3 point = vector_to_vec3(object["position"]);
+		point3 normal = vector_to_vec3(object["normal"]);
 
-		if (object["type"] == "csgobject") {
-			csgObject* newobject = new csgObject(material);
-			newobject->root = create_csgNode(object);
-			newobject->setBox();
+		created = new Plane(point, normal, material);
+	}
 
-			Objects.push_back(newobject);
-		}
+	if (object["type"] == "mesh") {
+		Mesh* mesh = new Mesh(material);
+		std::string file = object.find("file") != object.end() ? PATH + object["file"].get<std::string>() : "";
+		buildMesh(mesh, triangles, uvCoords, file, false);
+		created = mesh;
+	}
 
-		if (object["type"] == "box") {
-			BoundingBox box;
-			point3 p1 = vector_to_vec3(object["point1"]);
-			point3 p2 = vector_to_vec3(object["point2"]);
-			box.minX = std::min(p1.x, p2.x);
-			box.maxX = std::max(p1.x, p2.x);
-			box.minY = std::min(p1.y, p2.y);
-			box.maxY = std::max(p1.y, p2.y);
-			box.minZ = std::min(p1.z, p2.z);
-			box.maxZ = std::max(p1.z, p2.z);
+	if (object["type"] == "texturemesh") {
+		std::string texturefile = object["texture"];
 
-			Objects.push_back(new Box(box, material));
+		TextureMesh* mesh = new TextureMesh(material, PATH + texturefile);
+		prefetchTexture(mesh->texture);
+		std::string file = object.find("file") != object.end() ? PATH + object["file"].get<std::string>() : "";
+		buildMesh(mesh, triangles, uvCoords, file, true);
+		created = mesh;
+	}
+
+	if (object["type"] == "bumpsphere") {
+		point3 center = vector_to_vec3(object["position"]);
+		float radius = float(object["radius"]);
+		std::string bumpmapfile = object["bumpmap"];
+		float bumpDepth = object["bumpdepth"];
+
+		BumpSphere* sphere = new BumpSphere(center, radius, material, PATH + bumpmapfile, bumpDepth);
+		prefetchTexture(sphere->bumpmap);
+		created = sphere;
+	}
+
+	if (object["type"] == "csgobject") {
+		csgObject* newobject = new csgObject(material);
+		newobject->root = create_csgNode(object);
+		newobject->setBox();
+		created = newobject;
+	}
+
+	if (object["type"] == "box") {
+		BoundingBox box;
+		point3 p1 = vector_to_vec3(object["point1"]);
+		point3 p2 = vector_to_vec3(object["point2"]);
+		box.minX = std::min(p1.x, p2.x);
+		box.maxX = std::max(p1.x, p2.x);
+		box.minY = std::min(p1.y, p2.y);
+		box.maxY = std::max(p1.y, p2.y);
+		box.minZ = std::min(p1.z, p2.z);
+		box.maxZ = std::max(p1.z, p2.z);
+
+		created = new Box(box, material);
+	}
+
+	// loading progressively, meshes are added to the scene once they have been built
+	sceneObjects.push_back(created);
+	if (created != NULL && !(progressiveSceneLoading && dynamic_cast<Mesh*>(created) != NULL))
+		Objects.push_back(created);
+}
+
+// Flattens a nested json array of numbers for addObject.
+static void flatten(json& array, std::vector<float>& values) {
+	if (array.is_array()) {
+		for (json::iterator it = array.begin(); it != array.end(); ++it)
+			flatten(*it, values);
+	}
+	else if (array.is_number())
+		values.push_back(float(array));
+}
+
+/****************************************************************************/
+
+// Applies the camera settings. The streaming loader calls this as soon as the camera
+// has been parsed, so textures found after it can start decoding straight away.
+static void read_camera(json& camera) {
+	// these are optional parameters (otherwise they default to the values initialized earlier)
+	if (camera.find("field") != camera.end()) {
+		fov = camera["field"];
+		std::cout << "Setting fov to " << fov << " degrees.\n";
+	}
+	if (camera.find("background") != camera.end()) {
+		background_colour = vector_to_vec3(camera["background"]);
+		std::cout << "Setting background colour to " << glm::to_string(background_colour) << std::endl;
+	}
+	if (camera.find("lightsamples") != camera.end()) {
+		// sample this many positioned lights per shading point instead of shading with all of them
+		int samples = camera["lightsamples"];
+		if (samples > 0) {
+			lightSamplesPerPoint = samples;
+			stochasticLights = true;
+			std::cout << "Sampling " << lightSamplesPerPoint << " lights per point.\n";
 		}
+		else
+			std::cout << "Ignoring lightsamples of " << samples << ": at least one light must be sampled per point.\n";
+	}
+	if (camera.find("compresstextures") != camera.end()) {
+		// keep colour textures block compressed in memory
+		textureCache.compress = camera["compresstextures"];
+		std::cout << "Texture compression " << (textureCache.compress ? "on" : "off") << ".\n";
 	}
 
-	json lights = scene["lights"];
+	cameraRead = true;
+	for (int i = 0; i < pendingTextures.size(); i++)
+		prefetchTexture(pendingTextures[i]);
+	pendingTextures.clear();
+}
+
+static void read_lights(json& lights) {
 	for (json::iterator it = lights.begin(); it != lights.end(); ++it) {
 		json &light = *it;
 
@@ -297,15 +505,313 @@ void choose_scene(char const *fn) {
 			int numSamples = light["samples"];
 			Lights.push_back(new CircularAreaLight(colour, position, normal, radius, numSamples));
 		}
+		if (light["type"] == "environment") {
+			std::string mapfile = light["map"];
+			int numSamples = light["samples"];
+
+			// loading the map and tabulating its distribution overlaps the BVH build;
+			// the light takes its place in the list once it's done
+			environmentSlot = int(Lights.size());
+			Lights.push_back(NULL);
+			taskPool.run([=]() { environmentLight = new EnvironmentLight(colour, PATH + mapfile, numSamples); }, &lightTasks);
+		}
+	}
+}
+
+// Reads a scene JSON into Objects and Lights, along with the camera settings.
+static void load_json_scene(const std::string& fname) {
+	if (streamSceneLoading) {
+		// objects are built as they are parsed; what's left in the DOM is everything else
+		SceneStreamer* parser = NULL;
+		SceneStreamer streamer([&](json& object, std::vector<float>& triangles, std::vector<float>& uvCoords) {
+			if (!cameraRead && parser->scene.find("camera") != parser->scene.end())
+				read_camera(parser->scene["camera"]);
+			addObject(object, triangles, uvCoords);
+		});
+		parser = &streamer;
+		if (!loadScene(fname, streamer)) {
+			std::cout << "Unable to load scene file " << fname << ": " << streamer.error << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		scene = std::move(streamer.scene);
+	}
+	else {
+		std::fstream in(fname);
+		if (!in.is_open()) {
+			std::cout << "Unable to open scene file " << fname << std::endl;
+			exit(EXIT_FAILURE);
+		}
+
+		in >> scene;
+
+		json objects = scene["objects"];
+		for (json::iterator it = objects.begin(); it != objects.end(); ++it) {
+			json &object = *it;
+			std::vector<float> triangles, uvCoords;
+			if (object.find("triangles") != object.end())
+				flatten(object["triangles"], triangles);
+			if (object.find("uvCoords") != object.end())
+				flatten(object["uvCoords"], uvCoords);
+			addObject(object, triangles, uvCoords);
+		}
+	}
+	
+	if (!cameraRead)
+		read_camera(scene["camera"]);
+
+	read_lights(scene["lights"]);
+}
+
+// Maps a scene compiled by compile_scene; its meshes are used where they lie in the file.
+static void load_compiled_scene(const std::string& fname) {
+	SceneFileSettings settings;
+	std::string error;
+	if (!loadSceneFile(fname, Objects, Lights, settings, error)) {
+		std::cout << "Unable to load compiled scene " << fname << ": " << error << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	fov = settings.fov;
+	background_colour = settings.background;
+	if (settings.lightSamples > 0) {
+		lightSamplesPerPoint = settings.lightSamples;
+		stochasticLights = true;
+	}
+	textureCache.compress = settings.compressTextures;
+
+	for (int i = 0; i < Lights.size(); i++) {
+		if (Lights[i]->type == "environment")
+			environmentLight = (EnvironmentLight*)Lights[i];
+	}
+
+	cameraRead = true;
+	for (int i = 0; i < Objects.size(); i++) {
+		IndexedMesh* mesh = dynamic_cast<IndexedMesh*>(Objects[i]);
+		BumpSphere* sphere = dynamic_cast<BumpSphere*>(Objects[i]);
+		if (mesh != NULL && mesh->texture != NULL)
+			prefetchTexture(mesh->texture);
+		if (sphere != NULL)
+			prefetchTexture(sphere->bumpmap);
+	}
+}
+
+// Puts the environment light in its place once it has loaded and indexes the lights.
+static void finishLights() {
+	taskPool.wait(lightTasks);
+	if (environmentSlot >= 0)
+		Lights[environmentSlot] = environmentLight;
+
+	for (int i = 0; i < Lights.size(); i++)
+		Lights[i]->id = i;
+
+	lightBVH = new LightBVH(Lights);
+}
+
+void choose_scene(char const *fn) {
+	if (fn == NULL) {
+		std::cout << "Using default input file " << PATH << "c.json\n";
+		fn = "c";
+	}
+
+	std::cout << "Loading scene " << fn << std::endl;
+
+	// names ending in .rtsc are compiled scenes, anything else is the name of a JSON scene
+	std::string name = fn;
+	bool compiled = name.size() > 5 && name.compare(name.size() - 5, 5, ".rtsc") == 0;
+	std::string fname = PATH + name + (compiled ? "" : ".json");
+	sceneFile = compiled ? "" : fname;
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+	// rendering starts with whatever is ready; textures still loading are drawn plain
+	if (progressiveSceneLoading)
+		textureCache.waitForLoads = false;
+
+	if (compiled)
+		load_compiled_scene(fname);
+	else
+		load_json_scene(fname);
+
+	if (!progressiveSceneLoading) {
+		taskPool.wait(geometryTasks);
+
+		// meshes whose file couldn't be read have no triangles
+		int kept = 0;
+		for (int i = 0; i < Objects.size(); i++) {
+			if (Objects[i]->type == "mesh" && ((Mesh*)Objects[i])->triangles.empty()) {
+				std::replace(sceneObjects.begin(), sceneObjects.end(), Objects[i], (Object*)NULL);
+				delete Objects[i];
+			}
+			else
+				Objects[kept++] = Objects[i];
+		}
+		Objects.resize(kept);
 	}
 
 	// Create the BVH
 
 	bvh = new BVH(Objects);
+
+	finishLights();
+
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+	std::string loader = compiled ? "compiled scene" : streamSceneLoading ? "streaming" : "DOM";
+	std::cout << "Loaded " << Objects.size() << " objects in " << elapsed.count() << " s with the " << loader << " loader, peak memory " << (peakMemoryUsage() >> 20) << " MB" << std::endl;
+	if (assetsLoading > 0)
+		std::cout << assetsLoading << " meshes and textures are still loading" << std::endl;
 }
 
-bool trace(const point3& e, const point3& s, colour3& colour, bool pick, int reflectionCount) {
-	if (reflectionCount > MAX_REFLECTIONS) {
+bool applySceneUpdates(std::vector<BoundingBox>& changed) {
+	std::vector<SceneUpdate> updates;
+	{
+		std::lock_guard<std::mutex> lock(sceneUpdateMutex);
+		updates.swap(sceneUpdates);
+	}
+
+	for (int i = 0; i < updates.size(); i++) {
+		SceneUpdate& update = updates[i];
+
+		if (update.object != NULL && update.tree == NULL) {
+			// a mesh whose file couldn't be read
+			std::replace(sceneObjects.begin(), sceneObjects.end(), update.object, (Object*)NULL);
+			delete update.object;
+		}
+		else if (update.object != NULL) {
+			bvh->insert(update.tree);
+			Objects.push_back(update.object);
+			changed.push_back(update.object->boundingBox);
+		}
+		else {
+			for (int j = 0; j < Objects.size(); j++) {
+				if (usesTexture(Objects[j], update.texture))
+					changed.push_back(Objects[j]->boundingBox);
+			}
+		}
+		assetsLoading--;
+	}
+
+	if (!updates.empty())
+		std::cout << "Streamed in " << updates.size() << " meshes and textures, " << assetsLoading << " still loading" << std::endl;
+	return !updates.empty();
+}
+
+bool reload_lighting() {
+	if (sceneFile.empty()) {
+		std::cout << "Compiled scenes can't be reloaded" << std::endl;
+		return false;
+	}
+
+	// the geometry stays as it is; only the materials and lights are read again
+	std::vector<Material> materials;
+	SceneStreamer streamer([&](json& object, std::vector<float>& triangles, std::vector<float>& uvCoords) {
+		materials.push_back(read_material(object["material"]));
+	});
+	if (!loadScene(sceneFile, streamer)) {
+		std::cout << "Unable to reload scene file " << sceneFile << ": " << streamer.error << std::endl;
+		return false;
+	}
+
+	if (materials.size() == sceneObjects.size()) {
+		for (int i = 0; i < sceneObjects.size(); i++) {
+			Object* object = sceneObjects[i];
+			if (object == NULL)
+				continue;
+			object->material = materials[i];
+
+			Mesh* mesh = dynamic_cast<Mesh*>(object);
+			if (mesh != NULL) {
+				for (int j = 0; j < mesh->triangles.size(); j++)
+					mesh->triangles[j]->material = materials[i];
+			}
+		}
+	}
+	else
+		std::cout << "The scene now has " << materials.size() << " objects rather than " << sceneObjects.size() << "; materials were left as they were" << std::endl;
+
+	for (int i = 0; i < Lights.size(); i++)
+		delete Lights[i];
+	Lights.clear();
+	delete lightBVH;
+	environmentLight = NULL;
+	environmentSlot = -1;
+
+	read_lights(streamer.scene["lights"]);
+	finishLights();
+
+	// cached occluders may have become transparent, and the lights' ids have been reused
+	BVH::clearOccluderCaches();
+
+	std::cout << "Reloaded " << Lights.size() << " lights and " << materials.size() << " materials from " << sceneFile << std::endl;
+	return true;
+}
+
+bool sceneUpdatesWaiting() {
+	std::lock_guard<std::mutex> lock(sceneUpdateMutex);
+	return !sceneUpdates.empty();
+}
+
+int assetsStillLoading() {
+	return assetsLoading;
+}
+
+void compile_scene(char const *fn) {
+	choose_scene(fn);
+
+	SceneFileSettings settings;
+	settings.fov = float(fov);
+	settings.background = background_colour;
+	settings.lightSamples = stochasticLights ? lightSamplesPerPoint : 0;
+	settings.compressTextures = textureCache.compress;
+
+	std::string fname = PATH + std::string(fn) + ".rtsc";
+	std::string error;
+	if (!writeSceneFile(fname, Objects, Lights, settings, error)) {
+		std::cout << "Unable to compile scene to " << fname << ": " << error << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	std::cout << "Compiled scene to " << fname << std::endl;
+}
+
+colour3 background(const point3& direction) {
+	if (environmentLight != NULL)
+		return environmentLight->lookup(direction, pixelSpreadAngle);
+	return background_colour;
+}
+
+float hitFootprint() {
+	return footprint;
+}
+
+void printRenderStats() {
+	unsigned long long hits = bvh->occluderCacheHits.exchange(0);
+	unsigned long long misses = bvh->occluderCacheMisses.exchange(0);
+	if (hits + misses > 0)
+		std::cout << "Occluder cache: " << hits << " hits, " << misses << " misses (" << 100.0 * hits / (hits + misses) << "% hit rate)" << std::endl;
+
+	for (int i = 0; i < Lights.size(); i++) {
+		if (Lights[i]->type == "rectangularAreaLight" || Lights[i]->type == "circularAreaLight") {
+			AreaLight* light = (AreaLight*)Lights[i];
+			unsigned long long points = light->shadedPoints.exchange(0);
+			unsigned long long rays = light->tracedRays.exchange(0);
+			if (points > 0)
+				std::cout << "Light " << i << " (" << light->type << "): " << float(rays) / points << " shadow rays per hit, of " << light->sampleCount() << " samples" << std::endl;
+		}
+	}
+
+	textureCache.printStats();
+}
+
+static void shade(const point3& e, const point3& d, Object* hitObject, colour3& colour, bool pick, int reflectionCount, PrimaryHit* hit = NULL) {
+	// grow the cone to the hit point; secondary rays from this hit start out this wide
+	float originFootprint = footprint;
+	footprint = originFootprint + pixelSpreadAngle * glm::length(hitObject->cachedHitpoint - e);
+
+	hitObject->lightPoint(e, d, Lights, colour, reflectionCount, pick, hit != NULL ? &hit->albedo : NULL);
+
+	footprint = originFootprint;
+}
+
+bool trace(const point3& e, const point3& s, colour3& colour, bool pick, int reflectionCount, PrimaryHit* hit) {
+	if (reflectionCount > maxReflections) {
 		if (pick)
 			std::cout << "Maximum number of reflections reached." << std::endl;
 		colour = colour3(0, 0, 0);
@@ -314,16 +820,33 @@ bool trace(const point3& e, const point3& s, colour3& colour, bool pick, int ref
 
 	Object* hitObject = NULL;
 	point3 d = s - e;
+	raysByDepth[reflectionCount].fetch_add(1, std::memory_order_relaxed);
 
 	hitObject = bvh->findNearest(e, d);
 
+	// before shading, which may move the object's cached hit point
+	if (hit != NULL) {
+		hit->object = hitObject;
+		if (hitObject != NULL)
+			hitObject->saveHit(*hit);
+	}
+
 	if (hitObject == NULL)
 		return false;
 
 	if (pick)
 		std::cout << "object " << hitObject->type << " hit at {" << hitObject->cachedHitpoint[0] << ", " << hitObject->cachedHitpoint[1] << ", " << hitObject->cachedHitpoint[2] << "}" << std::endl;
 
-	hitObject->lightPoint(e, d, Lights, colour, reflectionCount, pick);
+	shade(e, d, hitObject, colour, pick, reflectionCount, hit);
+	return true;
+}
+
+bool shadeHit(const point3& e, const point3& s, PrimaryHit& hit, colour3& colour) {
+	if (hit.object == NULL)
+		return false;
 
+	// the albedo is taken again, in case the materials have been reloaded
+	hit.object->restoreHit(hit);
+	shade(e, s - e, hit.object, colour, false, 0, &hit);
 	return true;
 }
\ No newline at end of file
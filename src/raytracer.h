@@ -2,6 +2,8 @@
 #define RAYTRACER_H
 
 #include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
 
 #define MAX_T 10000.
 #define MAX_REFLECTIONS 16
@@ -9,13 +11,63 @@
 typedef glm::vec3 point3;
 typedef glm::vec3 colour3;
 
+struct ShadowRay;
+struct BoundingBox;
+class Light;
+class Object;
+
+// What a camera ray hit first, with the hit state the object kept for shading, so the
+// point can be shaded again without tracing the ray: the deferred relighting G-buffer.
+// Texture coordinates follow from the position and the material from the object.
+struct PrimaryHit {
+	Object* object; // NULL if it missed everything
+	point3 position;
+	point3 normal;
+	colour3 albedo;		// diffuse colour, for the denoiser
+	uint32_t primitive;	// for objects that keep which of their parts was hit
+};
+
 extern double fov;
 extern colour3 background_colour;
+extern float pixelSpreadAngle;
+extern bool streamSceneLoading; // parse scenes with the SAX loader rather than into a whole DOM
+extern bool progressiveSceneLoading; // start rendering before meshes and textures have loaded
+extern bool previewShading; // direct lighting only, with one sample of each area or environment light
+extern float lightSampleScale; // fraction of each area and environment light's samples taken, at least one
+extern int maxReflections; // reflections and refractions followed, at most MAX_REFLECTIONS
+
+// Rays traced since the last call to takeRayCounts, for estimating what a frame will cost:
+// camera and secondary rays by how deep they are, all shadow rays, and those of the lights
+// whose samples lightSampleScale scales.
+struct RayCounts {
+	unsigned long long byDepth[MAX_REFLECTIONS + 1];
+	unsigned long long shadow;
+	unsigned long long sampledShadow;
+};
 
 void choose_scene(char const *fn);
-bool trace(const point3 &e, const point3 &s, colour3 &colour, bool pick, int reflectionCount = 0);
+void compile_scene(char const *fn); // loads a JSON scene and writes it out as scenes/<fn>.rtsc
+
+// With progressive loading, adds the meshes and textures that have loaded since the last
+// call, and gives the bounds of the objects that changed. Rays mustn't be in flight.
+bool applySceneUpdates(std::vector<BoundingBox>& changed);
+bool reload_lighting(); // reads the lights and materials of the current scene again, keeping its geometry
+bool sceneUpdatesWaiting(); // cheap check for whether applySceneUpdates has anything to add
+int assetsStillLoading();
+bool trace(const point3 &e, const point3 &s, colour3 &colour, bool pick, int reflectionCount = 0, PrimaryHit* hit = NULL);
+bool shadeHit(const point3 &e, const point3 &s, PrimaryHit &hit, colour3 &colour); // like trace, from a recorded hit, whose albedo it updates
+colour3 background(const point3& direction); // seen by rays that miss everything
+
+bool shadowRay(const point3& point, const point3& lightPos, point3& shadow, int light = -1);
+void shadowRays(const point3& point, std::vector<ShadowRay>& rays);
+bool selectLights(const point3& point, const point3& N, std::vector<Light*>& lights, std::vector<float>& weights); // false to shade with every light
+
+float hitFootprint();
+int lightSampleCount(int samples); // the samples a light with this many takes with the current settings
+void countSampledShadowRays(int rays);
+void takeRayCounts(RayCounts& counts);
 
-bool shadowRay(const point3& point, const point3& lightPos, point3& shadow);
+void printRenderStats();
 
 
 #endif
\ No newline at end of file
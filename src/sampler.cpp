@@ -0,0 +1,198 @@
+#include "sampler.h"
+
+#include <cmath>
+#include <algorithm>
+
+SamplerType samplerType = SobolSampler;
+
+const char* samplerName(SamplerType type) {
+	switch (type) {
+	case RandomSampler: return "random";
+	case StratifiedSampler: return "stratified";
+	case HaltonSampler: return "Halton";
+	case SobolSampler: return "Sobol";
+	case BlueNoiseSampler: return "blue noise";
+	default: return "unknown";
+	}
+}
+
+// SplitMix64 finaliser, used to turn pixel coordinates into well-mixed seeds
+static uint64_t mix64(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+static float fract(float x) {
+	return x - std::floor(x);
+}
+
+/****************************************************************************/
+
+// RNG
+
+RNG::RNG(uint64_t seed) {
+	this->seed(seed);
+}
+
+void RNG::seed(uint64_t seed) {
+	state = 0;
+	nextUInt();
+	state += seed;
+	nextUInt();
+}
+
+uint32_t RNG::nextUInt() {
+	uint64_t old = state;
+	state = old * 6364136223846793005ull + 1442695040888963407ull;
+	uint32_t xorshifted = uint32_t(((old >> 18) ^ old) >> 27);
+	uint32_t rot = uint32_t(old >> 59);
+	return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+float RNG::nextFloat() {
+	// use the top 24 bits so the result is exactly representable and never rounds up to 1
+	return (nextUInt() >> 8) * (1.0f / 16777216.0f);
+}
+
+/****************************************************************************/
+
+// Sampler
+
+void Sampler::startPixel(int x, int y, int pass) {
+	pixelX = x;
+	pixelY = y;
+	this->pass = pass;
+	setIndex = 0;
+	rng.seed(mix64((uint64_t(uint32_t(x)) << 32 | uint32_t(y)) ^ mix64(uint64_t(pass))));
+}
+
+void Sampler::generate2D(int count, std::vector<glm::vec2>& samples) {
+	samples.resize(count);
+
+	switch (samplerType) {
+	case StratifiedSampler:
+		stratified2D(count, samples);
+		break;
+	case HaltonSampler:
+		halton2D(count, samples);
+		break;
+	case SobolSampler:
+		sobol2D(count, samples);
+		break;
+	case BlueNoiseSampler:
+		blueNoise2D(count, samples);
+		break;
+	default:
+		random2D(count, samples);
+		break;
+	}
+
+	setIndex++;
+}
+
+float Sampler::next1D() {
+	return rng.nextFloat();
+}
+
+void Sampler::random2D(int count, std::vector<glm::vec2>& samples) {
+	for (int i = 0; i < count; i++) {
+		samples[i].x = rng.nextFloat();
+		samples[i].y = rng.nextFloat();
+	}
+}
+
+void Sampler::stratified2D(int count, std::vector<glm::vec2>& samples) {
+	// jittered grid; when count isn't a perfect square a random subset of the cells is used
+	int nx = int(std::ceil(std::sqrt(float(count))));
+	int ny = (count + nx - 1) / nx;
+
+	std::vector<int> cells(nx * ny);
+	for (int i = 0; i < cells.size(); i++)
+		cells[i] = i;
+	for (int i = 0; i < count; i++)
+		std::swap(cells[i], cells[i + rng.nextUInt() % (cells.size() - i)]);
+
+	for (int i = 0; i < count; i++) {
+		int cx = cells[i] % nx;
+		int cy = cells[i] / nx;
+		samples[i].x = (cx + rng.nextFloat()) / nx;
+		samples[i].y = (cy + rng.nextFloat()) / ny;
+	}
+}
+
+static float radicalInverse(int base, uint32_t i) {
+	float invBase = 1.0f / base;
+	float factor = invBase;
+	float result = 0;
+	while (i > 0) {
+		result += (i % base) * factor;
+		i /= base;
+		factor *= invBase;
+	}
+	return result;
+}
+
+void Sampler::halton2D(int count, std::vector<glm::vec2>& samples) {
+	// bases 2 and 3, decorrelated between sets with a random toroidal shift (Cranley-Patterson rotation)
+	float shiftX = rng.nextFloat();
+	float shiftY = rng.nextFloat();
+
+	for (int i = 0; i < count; i++) {
+		samples[i].x = fract(radicalInverse(2, i + 1) + shiftX);
+		samples[i].y = fract(radicalInverse(3, i + 1) + shiftY);
+	}
+}
+
+static uint32_t reverseBits(uint32_t v) {
+	v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+	v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+	v = ((v >> 4) & 0x0F0F0F0F) | ((v & 0x0F0F0F0F) << 4);
+	v = ((v >> 8) & 0x00FF00FF) | ((v & 0x00FF00FF) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+static uint32_t sobolSecondDimension(uint32_t i) {
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1) {
+		if (i & 1)
+			result ^= v;
+	}
+	return result;
+}
+
+void Sampler::sobol2D(int count, std::vector<glm::vec2>& samples) {
+	// the first two Sobol dimensions form a (0,2)-sequence: every power-of-two prefix
+	// is stratified in every elementary interval. A random digital shift (xor scramble)
+	// per set keeps that property while decorrelating sets.
+	uint32_t scrambleX = rng.nextUInt();
+	uint32_t scrambleY = rng.nextUInt();
+
+	for (int i = 0; i < count; i++) {
+		samples[i].x = ((reverseBits(i) ^ scrambleX) >> 8) * (1.0f / 16777216.0f);
+		samples[i].y = ((sobolSecondDimension(i) ^ scrambleY) >> 8) * (1.0f / 16777216.0f);
+	}
+}
+
+void Sampler::blueNoise2D(int count, std::vector<glm::vec2>& samples) {
+	// R2 sequence points, shifted per pixel by an R2 dither mask. Neighbouring pixels get
+	// maximally different shifts, so their error is spread as high-frequency (blue) noise
+	// across the image rather than as clumps.
+	const float a1 = 0.7548776662f; // 1/g and 1/g^2, g being the plastic number
+	const float a2 = 0.5698402910f;
+
+	int set = setIndex + pass * 97;
+	float shiftX = fract(pixelX * a1 + pixelY * a2 + set * a1);
+	float shiftY = fract(pixelX * a2 + pixelY * a1 + set * a2);
+
+	for (int i = 0; i < count; i++) {
+		samples[i].x = fract(shiftX + (i + 1) * a1);
+		samples[i].y = fract(shiftY + (i + 1) * a2);
+	}
+}
+
+Sampler& threadSampler() {
+	static thread_local Sampler sampler;
+	return sampler;
+}
@@ -0,0 +1,47 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+enum SamplerType { RandomSampler, StratifiedSampler, HaltonSampler, SobolSampler, BlueNoiseSampler, NumSamplerTypes };
+
+extern SamplerType samplerType;
+const char* samplerName(SamplerType type);
+
+// Small, fast PCG32 random number generator. Each sampler owns one, so threads never share state.
+class RNG {
+public:
+	RNG(uint64_t seed = 0);
+	void seed(uint64_t seed);
+	uint32_t nextUInt();
+	float nextFloat(); // uniform in [0, 1)
+private:
+	uint64_t state;
+};
+
+// Generates well-distributed sample points in the unit square. The random state is
+// reset at the start of every pixel, so a pixel's samples don't depend on which thread
+// renders it or on the order pixels are rendered in.
+class Sampler {
+public:
+	int pixelX = 0;
+	int pixelY = 0;
+	int pass = 0;
+	void startPixel(int x, int y, int pass = 0);
+	void generate2D(int count, std::vector<glm::vec2>& samples);
+	float next1D();
+private:
+	RNG rng;
+	int setIndex = 0; // number of sample sets generated so far for this pixel
+	void random2D(int count, std::vector<glm::vec2>& samples);
+	void stratified2D(int count, std::vector<glm::vec2>& samples);
+	void halton2D(int count, std::vector<glm::vec2>& samples);
+	void sobol2D(int count, std::vector<glm::vec2>& samples);
+	void blueNoise2D(int count, std::vector<glm::vec2>& samples);
+};
+
+Sampler& threadSampler();
+
+#endif
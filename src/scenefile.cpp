@@ -0,0 +1,485 @@
+#include "scenefile.h"
+#include "bump.h"
+#include "csg.h"
+#include "arealight.h"
+#include "envlight.h"
+#include "texturemesh.h"
+#include "mappedfile.h"
+
+#include <cstring>
+#include <fstream>
+#include <map>
+
+static_assert(sizeof(point3) == 12 && sizeof(glm::vec2) == 8, "vectors must be tightly packed floats");
+static_assert(sizeof(MeshBVHNode) == 32, "unexpected MeshBVHNode layout");
+static_assert(sizeof(Material) == 17 * sizeof(float), "unexpected Material layout");
+
+/****************************************************************************/
+
+// Writing
+
+// Collects the records and buffers of a scene before they are written out.
+struct SceneFileBuilder {
+	std::vector<PackedObject> objects;
+	std::vector<PackedMesh> meshes;
+	std::vector<PackedCSGNode> csgNodes;
+	std::vector<PackedLight> lights;
+	std::vector<point3> vertices;
+	std::vector<point3> normals;
+	std::vector<uint32_t> indices;
+	std::vector<glm::vec2> uvs;
+	std::vector<uint32_t> uvIndices;
+	std::vector<MeshBVHNode> nodes;
+	std::string strings;
+	std::map<std::string, uint32_t> stringOffsets;
+	std::string error;
+
+	uint32_t addString(const std::string& s);
+	uint32_t addMesh(IndexedMesh* mesh);
+	bool addObject(Object* object, uint32_t flags);
+	uint32_t addCSGNode(csg_node* node);
+	bool addLight(Light* light);
+};
+
+static void pack(float* values, const point3& v) {
+	values[0] = v.x;
+	values[1] = v.y;
+	values[2] = v.z;
+}
+
+uint32_t SceneFileBuilder::addString(const std::string& s) {
+	std::map<std::string, uint32_t>::iterator it = stringOffsets.find(s);
+	if (it != stringOffsets.end())
+		return it->second;
+
+	uint32_t offset = uint32_t(strings.size());
+	strings.append(s.c_str(), s.size() + 1);
+	stringOffsets[s] = offset;
+	return offset;
+}
+
+uint32_t SceneFileBuilder::addMesh(IndexedMesh* mesh) {
+	PackedMesh packed;
+	packed.vertices = vertices.size();
+	packed.normals = normals.size();
+	packed.indices = indices.size();
+	packed.uvs = uvs.size();
+	packed.uvIndices = uvIndices.size();
+	packed.nodes = nodes.size();
+	packed.vertexCount = uint32_t(mesh->ownedVertices.size());
+	packed.triangleCount = mesh->triangleCount;
+	packed.uvCount = 0;
+	packed.nodeCount = mesh->nodeCount;
+	packed.texture = SCENE_FILE_NO_STRING;
+	packed.padding = 0;
+
+	// a mesh built by build() owns its buffers; its vertex count isn't kept otherwise
+	vertices.insert(vertices.end(), mesh->ownedVertices.begin(), mesh->ownedVertices.end());
+	normals.insert(normals.end(), mesh->normals, mesh->normals + mesh->triangleCount);
+	indices.insert(indices.end(), mesh->indices, mesh->indices + 3 * mesh->triangleCount);
+	nodes.insert(nodes.end(), mesh->nodes, mesh->nodes + mesh->nodeCount);
+
+	if (mesh->texture != NULL && mesh->uvs != NULL) {
+		packed.texture = addString(mesh->texture->path);
+		packed.uvCount = uint32_t(mesh->ownedUVs.size());
+		uvs.insert(uvs.end(), mesh->ownedUVs.begin(), mesh->ownedUVs.end());
+		uvIndices.insert(uvIndices.end(), mesh->uvIndices, mesh->uvIndices + 3 * mesh->triangleCount);
+	}
+
+	meshes.push_back(packed);
+	return uint32_t(meshes.size() - 1);
+}
+
+bool SceneFileBuilder::addObject(Object* object, uint32_t flags) {
+	PackedObject packed = PackedObject();
+	packed.flags = flags;
+	packed.string = SCENE_FILE_NO_STRING;
+	packed.material = object->material;
+
+	BumpSphere* bumpSphere = dynamic_cast<BumpSphere*>(object);
+	Sphere* sphere = dynamic_cast<Sphere*>(object);
+	Plane* plane = dynamic_cast<Plane*>(object);
+	Mesh* mesh = dynamic_cast<Mesh*>(object);
+	csgObject* csg = dynamic_cast<csgObject*>(object);
+
+	if (bumpSphere != NULL || sphere != NULL) {
+		packed.type = bumpSphere != NULL ? SceneBumpSphere : SceneSphere;
+		pack(packed.params, sphere->center);
+		packed.params[3] = sphere->radius;
+		if (bumpSphere != NULL) {
+			packed.params[4] = bumpSphere->bumpDepth;
+			packed.string = addString(bumpSphere->bumpmap->path);
+		}
+	}
+	else if (plane != NULL) {
+		packed.type = ScenePlane;
+		pack(packed.params, plane->point);
+		pack(packed.params + 3, plane->normal);
+	}
+	else if (object->type == "box") {
+		packed.type = SceneBox;
+		packed.params[0] = object->boundingBox.minX;
+		packed.params[1] = object->boundingBox.minY;
+		packed.params[2] = object->boundingBox.minZ;
+		packed.params[3] = object->boundingBox.maxX;
+		packed.params[4] = object->boundingBox.maxY;
+		packed.params[5] = object->boundingBox.maxZ;
+	}
+	else if (mesh != NULL) {
+		IndexedMesh indexed(mesh->material);
+		indexed.build(mesh);
+		packed.type = SceneMesh;
+		packed.index = addMesh(&indexed);
+	}
+	else if (csg != NULL) {
+		packed.type = SceneCSG;
+		packed.index = addCSGNode(csg->root);
+		if (!error.empty())
+			return false;
+	}
+	else {
+		error = "objects of type " + object->type + " can't be compiled";
+		return false;
+	}
+
+	objects.push_back(packed);
+	return true;
+}
+
+uint32_t SceneFileBuilder::addCSGNode(csg_node* node) {
+	// nodes are stored parent first, so children always have larger indices
+	uint32_t index = uint32_t(csgNodes.size());
+	csgNodes.push_back(PackedCSGNode());
+	csgNodes[index].op = node->op;
+	csgNodes[index].first = 0;
+	csgNodes[index].second = 0;
+	csgNodes[index].object = 0;
+
+	if (node->op == NoOp) {
+		if (addObject(node->object, SCENE_OBJECT_CSG_LEAF))
+			csgNodes[index].object = uint32_t(objects.size() - 1);
+	}
+	else {
+		uint32_t first = addCSGNode(node->first);
+		uint32_t second = addCSGNode(node->second);
+		csgNodes[index].first = first;
+		csgNodes[index].second = second;
+	}
+	return index;
+}
+
+bool SceneFileBuilder::addLight(Light* light) {
+	PackedLight packed;
+	memset(&packed, 0, sizeof(packed));
+	packed.string = SCENE_FILE_NO_STRING;
+	pack(packed.colour, light->colour);
+
+	if (light->type == "ambient")
+		packed.type = SceneAmbient;
+	else if (light->type == "directional") {
+		packed.type = SceneDirectional;
+		pack(packed.direction, ((Directional*)light)->direction);
+	}
+	else if (light->type == "point") {
+		packed.type = ScenePoint;
+		pack(packed.position, ((Point*)light)->position);
+	}
+	else if (light->type == "spot") {
+		Spot* spot = (Spot*)light;
+		packed.type = SceneSpot;
+		pack(packed.position, spot->position);
+		pack(packed.direction, spot->direction);
+		packed.params[0] = spot->cutoff;
+	}
+	else if (light->type == "rectangularAreaLight" || light->type == "circularAreaLight") {
+		AreaLight* area = (AreaLight*)light;
+		pack(packed.position, area->position);
+		pack(packed.direction, area->normal);
+		packed.samples = area->numSamples;
+		if (light->type == "rectangularAreaLight") {
+			// planeY gives back planeX when crossed with the normal, so it serves as the orientation
+			packed.type = SceneRectangular;
+			pack(packed.orientation, area->planeY);
+			packed.params[0] = ((RectangularAreaLight*)light)->width;
+			packed.params[1] = ((RectangularAreaLight*)light)->height;
+		}
+		else {
+			packed.type = SceneCircular;
+			packed.params[0] = ((CircularAreaLight*)light)->radius;
+		}
+	}
+	else if (light->type == "environment") {
+		EnvironmentLight* environment = (EnvironmentLight*)light;
+		packed.type = SceneEnvironment;
+		packed.samples = environment->numSamples;
+		packed.string = addString(environment->mapfile);
+	}
+	else {
+		error = "lights of type " + light->type + " can't be compiled";
+		return false;
+	}
+
+	lights.push_back(packed);
+	return true;
+}
+
+// Appends an array at the next aligned offset and records where it went.
+template <typename T>
+static void writeArray(std::ofstream& out, uint64_t& offset, const std::vector<T>& values, SceneFileArray& array) {
+	static const char zeros[SCENE_FILE_ALIGNMENT] = { 0 };
+	uint64_t aligned = (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+	out.write(zeros, std::streamsize(aligned - offset));
+
+	array.offset = aligned;
+	array.count = values.size();
+	if (!values.empty())
+		out.write((const char*)values.data(), std::streamsize(values.size() * sizeof(T)));
+	offset = aligned + values.size() * sizeof(T);
+}
+
+bool writeSceneFile(std::string filename, const std::vector<Object*>& objects, const std::vector<Light*>& lights, const SceneFileSettings& settings, std::string& error) {
+	SceneFileBuilder builder;
+
+	for (size_t i = 0; i < objects.size(); i++) {
+		if (!builder.addObject(objects[i], 0)) {
+			error = builder.error;
+			return false;
+		}
+	}
+	for (size_t i = 0; i < lights.size(); i++) {
+		if (!builder.addLight(lights[i])) {
+			error = builder.error;
+			return false;
+		}
+	}
+
+	SceneFileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = SCENE_FILE_MAGIC;
+	header.version = SCENE_FILE_VERSION;
+	header.fov = settings.fov;
+	pack(header.background, settings.background);
+	header.lightSamples = settings.lightSamples;
+	header.compressTextures = settings.compressTextures;
+
+	std::ofstream out(filename, std::ios::binary);
+	if (!out.is_open()) {
+		error = "can't open the file for writing";
+		return false;
+	}
+
+	// the header is written again at the end, once the array offsets are known
+	out.write((const char*)&header, sizeof(header));
+	uint64_t offset = sizeof(header);
+
+	std::vector<char> strings(builder.strings.begin(), builder.strings.end());
+	writeArray(out, offset, builder.objects, header.objects);
+	writeArray(out, offset, builder.meshes, header.meshes);
+	writeArray(out, offset, builder.csgNodes, header.csgNodes);
+	writeArray(out, offset, builder.lights, header.lights);
+	writeArray(out, offset, builder.vertices, header.vertices);
+	writeArray(out, offset, builder.normals, header.normals);
+	writeArray(out, offset, builder.indices, header.indices);
+	writeArray(out, offset, builder.uvs, header.uvs);
+	writeArray(out, offset, builder.uvIndices, header.uvIndices);
+	writeArray(out, offset, builder.nodes, header.nodes);
+	writeArray(out, offset, strings, header.strings);
+
+	out.seekp(0);
+	out.write((const char*)&header, sizeof(header));
+
+	if (!out.good()) {
+		error = "write failed";
+		return false;
+	}
+	return true;
+}
+
+/****************************************************************************/
+
+// Loading
+
+// Points values at an array of the mapped file, if it lies wholly inside the file.
+template <typename T>
+static bool mapArray(const MappedFile& file, const SceneFileArray& array, const T*& values) {
+	values = (const T*)(file.data + array.offset);
+	return array.offset % SCENE_FILE_ALIGNMENT == 0 && array.offset <= file.size && array.count <= (file.size - array.offset) / sizeof(T);
+}
+
+static point3 unpack(const float* values) {
+	return point3(values[0], values[1], values[2]);
+}
+
+// Children were checked to come after their parents, so this always ends.
+static csg_node* buildCSGNode(const PackedCSGNode* nodes, uint32_t index, const std::vector<Object*>& built) {
+	const PackedCSGNode& packed = nodes[index];
+	if (packed.op == NoOp)
+		return new csg_node(built[packed.object]);
+
+	csg_node* node = new csg_node(Operation(packed.op));
+	node->first = buildCSGNode(nodes, packed.first, built);
+	node->second = buildCSGNode(nodes, packed.second, built);
+	return node;
+}
+
+bool loadSceneFile(std::string filename, std::vector<Object*>& objects, std::vector<Light*>& lights, SceneFileSettings& settings, std::string& error) {
+	// never closed, since the meshes' buffers live in it
+	MappedFile* file = new MappedFile();
+	if (!file->open(filename)) {
+		error = "can't open the file";
+		delete file;
+		return false;
+	}
+
+	SceneFileHeader header;
+	if (file->size < sizeof(header)) {
+		error = "file is too short";
+		return false;
+	}
+	memcpy(&header, file->data, sizeof(header));
+	if (header.magic != SCENE_FILE_MAGIC) {
+		error = "not a compiled scene";
+		return false;
+	}
+	if (header.version != SCENE_FILE_VERSION) {
+		error = "compiled by a different version, recompile it";
+		return false;
+	}
+
+	const PackedObject* packedObjects;
+	const PackedMesh* packedMeshes;
+	const PackedCSGNode* packedNodes;
+	const PackedLight* packedLights;
+	const point3* vertices;
+	const point3* normals;
+	const uint32_t* indices;
+	const glm::vec2* uvs;
+	const uint32_t* uvIndices;
+	const MeshBVHNode* nodes;
+	const char* strings;
+
+	if (!mapArray(*file, header.objects, packedObjects) || !mapArray(*file, header.meshes, packedMeshes) ||
+		!mapArray(*file, header.csgNodes, packedNodes) || !mapArray(*file, header.lights, packedLights) ||
+		!mapArray(*file, header.vertices, vertices) || !mapArray(*file, header.normals, normals) ||
+		!mapArray(*file, header.indices, indices) || !mapArray(*file, header.uvs, uvs) ||
+		!mapArray(*file, header.uvIndices, uvIndices) || !mapArray(*file, header.nodes, nodes) ||
+		!mapArray(*file, header.strings, strings) || (header.strings.count > 0 && strings[header.strings.count - 1] != 0)) {
+		error = "file is truncated or corrupt";
+		return false;
+	}
+
+	// Only the records are checked, not every index of every triangle, which would
+	// cost as much as the parsing this format avoids.
+	for (uint64_t i = 0; i < header.meshes.count; i++) {
+		const PackedMesh& mesh = packedMeshes[i];
+		bool textured = mesh.texture != SCENE_FILE_NO_STRING;
+		if (mesh.vertices + mesh.vertexCount > header.vertices.count || mesh.normals + mesh.triangleCount > header.normals.count ||
+			mesh.indices + 3 * uint64_t(mesh.triangleCount) > header.indices.count || mesh.nodes + mesh.nodeCount > header.nodes.count ||
+			(mesh.triangleCount > 0 && mesh.nodeCount == 0) ||
+			(textured && (mesh.texture >= header.strings.count || mesh.uvs + mesh.uvCount > header.uvs.count ||
+			mesh.uvIndices + 3 * uint64_t(mesh.triangleCount) > header.uvIndices.count))) {
+			error = "mesh " + std::to_string(i) + " is out of range";
+			return false;
+		}
+	}
+	for (uint64_t i = 0; i < header.csgNodes.count; i++) {
+		const PackedCSGNode& node = packedNodes[i];
+		bool valid = node.op == NoOp ? node.object < header.objects.count && packedObjects[node.object].type != SceneCSG :
+			node.op <= Difference && node.first > i && node.first < header.csgNodes.count && node.second > i && node.second < header.csgNodes.count;
+		if (!valid) {
+			error = "CSG node " + std::to_string(i) + " is out of range";
+			return false;
+		}
+	}
+
+	// CSG objects are put together once the objects in their trees exist
+	std::vector<Object*> built(header.objects.count, NULL);
+	for (uint64_t i = 0; i < header.objects.count; i++) {
+		const PackedObject& packed = packedObjects[i];
+		const float* params = packed.params;
+
+		if (packed.string != SCENE_FILE_NO_STRING && packed.string >= header.strings.count) {
+			error = "object " + std::to_string(i) + " is out of range";
+			return false;
+		}
+
+		if (packed.type == SceneSphere)
+			built[i] = new Sphere(unpack(params), params[3], packed.material);
+		else if (packed.type == SceneBumpSphere && packed.string != SCENE_FILE_NO_STRING)
+			built[i] = new BumpSphere(unpack(params), params[3], packed.material, strings + packed.string, params[4]);
+		else if (packed.type == ScenePlane)
+			built[i] = new Plane(unpack(params), unpack(params + 3), packed.material);
+		else if (packed.type == SceneBox) {
+			BoundingBox box;
+			box.minX = params[0];
+			box.minY = params[1];
+			box.minZ = params[2];
+			box.maxX = params[3];
+			box.maxY = params[4];
+			box.maxZ = params[5];
+			built[i] = new Box(box, packed.material);
+		}
+		else if (packed.type == SceneMesh && packed.index < header.meshes.count) {
+			const PackedMesh& mesh = packedMeshes[packed.index];
+			IndexedMesh* indexed = new IndexedMesh(packed.material);
+			bool textured = mesh.texture != SCENE_FILE_NO_STRING;
+			if (textured)
+				indexed->texture = textureCache.find(strings + mesh.texture);
+			indexed->setBuffers(vertices + mesh.vertices, normals + mesh.normals, indices + mesh.indices, textured ? uvs + mesh.uvs : NULL,
+				textured ? uvIndices + mesh.uvIndices : NULL, nodes + mesh.nodes, mesh.triangleCount, mesh.nodeCount);
+			built[i] = indexed;
+		}
+		else if (packed.type == SceneCSG && packed.index < header.csgNodes.count)
+			continue;
+		else {
+			error = "object " + std::to_string(i) + " is corrupt";
+			return false;
+		}
+	}
+
+	for (uint64_t i = 0; i < header.objects.count; i++) {
+		if (packedObjects[i].type == SceneCSG) {
+			csgObject* csg = new csgObject(packedObjects[i].material);
+			csg->root = buildCSGNode(packedNodes, packedObjects[i].index, built);
+			csg->setBox();
+			built[i] = csg;
+		}
+	}
+
+	for (uint64_t i = 0; i < header.objects.count; i++) {
+		if (!(packedObjects[i].flags & SCENE_OBJECT_CSG_LEAF) && !(packedObjects[i].type == SceneMesh && packedMeshes[packedObjects[i].index].triangleCount == 0))
+			objects.push_back(built[i]);
+	}
+
+	for (uint64_t i = 0; i < header.lights.count; i++) {
+		const PackedLight& packed = packedLights[i];
+		colour3 colour = unpack(packed.colour);
+		point3 position = unpack(packed.position);
+		point3 direction = unpack(packed.direction);
+
+		if (packed.type == SceneAmbient)
+			lights.push_back(new Ambient(colour));
+		else if (packed.type == SceneDirectional)
+			lights.push_back(new Directional(colour, direction));
+		else if (packed.type == ScenePoint)
+			lights.push_back(new Point(colour, position));
+		else if (packed.type == SceneSpot)
+			lights.push_back(new Spot(colour, position, direction, packed.params[0]));
+		else if (packed.type == SceneRectangular)
+			lights.push_back(new RectangularAreaLight(colour, position, direction, packed.params[0], packed.params[1], unpack(packed.orientation), packed.samples));
+		else if (packed.type == SceneCircular)
+			lights.push_back(new CircularAreaLight(colour, position, direction, packed.params[0], packed.samples));
+		else if (packed.type == SceneEnvironment && packed.string < header.strings.count)
+			lights.push_back(new EnvironmentLight(colour, strings + packed.string, packed.samples));
+		else {
+			error = "light " + std::to_string(i) + " is corrupt";
+			return false;
+		}
+	}
+
+	settings.fov = header.fov;
+	settings.background = unpack(header.background);
+	settings.lightSamples = header.lightSamples;
+	settings.compressTextures = header.compressTextures != 0;
+	return true;
+}
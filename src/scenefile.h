@@ -0,0 +1,109 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include "objects.h"
+#include "indexedmesh.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define SCENE_FILE_MAGIC 0x43535452 // "RTSC" when read as bytes
+#define SCENE_FILE_VERSION 1
+#define SCENE_FILE_ALIGNMENT 16 // every array starts on a multiple of this many bytes
+#define SCENE_FILE_NO_STRING 0xffffffffu
+
+// A compiled scene is a header followed by arrays of plain records, written in the
+// machine's own byte order. Mesh geometry is stored as the buffers of an IndexedMesh,
+// BVH included, so loading maps the file and points the meshes straight into it
+// instead of parsing and allocating every triangle. Strings (texture paths) are kept
+// null terminated in one blob and referred to by offset.
+
+enum SceneObjectType { SceneSphere, ScenePlane, SceneBox, SceneBumpSphere, SceneMesh, SceneCSG };
+enum SceneLightType { SceneAmbient, SceneDirectional, ScenePoint, SceneSpot, SceneRectangular, SceneCircular, SceneEnvironment };
+
+#define SCENE_OBJECT_CSG_LEAF 1 // only used as part of a CSG tree, not added to the scene
+
+struct SceneFileArray {
+	uint64_t offset; // in bytes from the start of the file
+	uint64_t count;
+};
+
+struct SceneFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	float fov;
+	float background[3];
+	int32_t lightSamples; // lights sampled per point, or 0 to shade with all of them
+	int32_t compressTextures;
+	SceneFileArray objects;		// PackedObject
+	SceneFileArray meshes;		// PackedMesh
+	SceneFileArray csgNodes;	// PackedCSGNode
+	SceneFileArray lights;		// PackedLight
+	SceneFileArray vertices;	// point3
+	SceneFileArray normals;		// point3
+	SceneFileArray indices;		// uint32_t
+	SceneFileArray uvs;			// glm::vec2
+	SceneFileArray uvIndices;	// uint32_t
+	SceneFileArray nodes;		// MeshBVHNode
+	SceneFileArray strings;		// char
+};
+
+struct PackedObject {
+	uint32_t type;
+	uint32_t flags;
+	uint32_t index;		// of the mesh, or the root CSG node
+	uint32_t string;	// bump map path
+	float params[8];	// sphere: centre, radius, bump depth; plane: point, normal; box: min, max
+	Material material;
+};
+
+// Offsets and counts are in elements of the shared vertex, normal, ... arrays.
+struct PackedMesh {
+	uint64_t vertices;
+	uint64_t normals;
+	uint64_t indices;
+	uint64_t uvs;
+	uint64_t uvIndices;
+	uint64_t nodes;
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	uint32_t uvCount;
+	uint32_t nodeCount;
+	uint32_t texture;
+	uint32_t padding;
+};
+
+struct PackedCSGNode {
+	uint32_t op;		// an Operation; NoOp for leaves
+	uint32_t first;		// child nodes
+	uint32_t second;
+	uint32_t object;	// leaf object
+};
+
+struct PackedLight {
+	uint32_t type;
+	int32_t samples;
+	uint32_t string;	// environment map path
+	float colour[3];
+	float position[3];
+	float direction[3];		// or an area light's normal
+	float orientation[3];	// up direction of a rectangular light
+	float params[2];		// spot cutoff; rectangle width and height; circle radius
+};
+
+struct SceneFileSettings {
+	float fov;
+	colour3 background;
+	int lightSamples;
+	bool compressTextures;
+};
+
+// Writes the loaded scene out. Meshes are indexed and get their BVH built here.
+bool writeSceneFile(std::string filename, const std::vector<Object*>& objects, const std::vector<Light*>& lights, const SceneFileSettings& settings, std::string& error);
+
+// Maps a compiled scene and appends its objects and lights. The mapping is kept open
+// for the rest of the run, since the meshes use it as their buffers.
+bool loadSceneFile(std::string filename, std::vector<Object*>& objects, std::vector<Light*>& lights, SceneFileSettings& settings, std::string& error);
+
+#endif
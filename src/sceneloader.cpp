@@ -0,0 +1,174 @@
+#include "sceneloader.h"
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#  include <psapi.h>
+#  pragma comment(lib, "psapi.lib")
+#else
+#  include <sys/resource.h>
+#endif
+
+// The objects array is the second level of the file and its entries the third:
+// { "objects": [ { "triangles": [ ...
+#define OBJECTS_DEPTH 2
+#define OBJECT_DEPTH 3
+
+SceneStreamer::SceneStreamer(ObjectHandler addObject) : addObject(addObject), element(NULL), depth(0), objectsNext(false), inObjects(false), stream(NULL), streamDepth(0) {
+}
+
+json* SceneStreamer::addValue(json value) {
+	if (stack.empty()) {
+		scene = std::move(value);
+		return &scene;
+	}
+
+	json* parent = stack.back();
+	if (parent->is_array()) {
+		parent->push_back(std::move(value));
+		return &parent->back();
+	}
+
+	*element = std::move(value);
+	return element;
+}
+
+bool SceneStreamer::addNumber(float value, json jsonValue) {
+	if (stream != NULL)
+		stream->push_back(value);
+	else
+		addValue(std::move(jsonValue));
+	return true;
+}
+
+bool SceneStreamer::null() {
+	if (stream == NULL)
+		addValue(json());
+	return true;
+}
+
+bool SceneStreamer::boolean(bool val) {
+	if (stream == NULL)
+		addValue(val);
+	return true;
+}
+
+bool SceneStreamer::number_integer(number_integer_t val) {
+	return addNumber(float(val), val);
+}
+
+bool SceneStreamer::number_unsigned(number_unsigned_t val) {
+	return addNumber(float(val), val);
+}
+
+bool SceneStreamer::number_float(number_float_t val, const string_t& s) {
+	return addNumber(float(val), val);
+}
+
+bool SceneStreamer::string(string_t& val) {
+	if (stream == NULL)
+		addValue(val);
+	return true;
+}
+
+bool SceneStreamer::start_object(std::size_t elements) {
+	depth++;
+	if (inObjects && depth == OBJECT_DEPTH) {
+		// each object is built on its own, not as part of the scene
+		object = json::object();
+		stack.push_back(&object);
+		return true;
+	}
+
+	stack.push_back(addValue(json::object()));
+	return true;
+}
+
+bool SceneStreamer::key(string_t& val) {
+	if (inObjects && depth == OBJECT_DEPTH && (val == "triangles" || val == "uvCoords")) {
+		stream = val == "triangles" ? &triangles : &uvCoords;
+		streamDepth = depth;
+		return true;
+	}
+
+	objectsNext = depth == 1 && val == "objects";
+	element = &(*stack.back())[val];
+	return true;
+}
+
+bool SceneStreamer::end_object() {
+	stack.pop_back();
+
+	if (inObjects && depth == OBJECT_DEPTH) {
+		addObject(object, triangles, uvCoords);
+		object = json();
+		triangles.clear();
+		uvCoords.clear();
+	}
+
+	depth--;
+	return true;
+}
+
+bool SceneStreamer::start_array(std::size_t elements) {
+	depth++;
+	if (stream != NULL)
+		return true;
+
+	if (objectsNext && depth == OBJECTS_DEPTH)
+		inObjects = true;
+	objectsNext = false;
+
+	stack.push_back(addValue(json::array()));
+	return true;
+}
+
+bool SceneStreamer::end_array() {
+	depth--;
+	if (stream != NULL) {
+		if (depth == streamDepth)
+			stream = NULL;
+		return true;
+	}
+
+	stack.pop_back();
+	if (inObjects && depth == OBJECTS_DEPTH - 1)
+		inObjects = false;
+	return true;
+}
+
+bool SceneStreamer::parse_error(std::size_t position, const std::string& last_token, const nlohmann::detail::exception& ex) {
+	error = ex.what();
+	return false;
+}
+
+bool loadScene(std::string filename, SceneStreamer& streamer) {
+	// the file is parsed straight out of the mapping, without reading it into a buffer first
+	MappedFile file;
+	if (!file.open(filename)) {
+		streamer.error = "unable to open file";
+		return false;
+	}
+
+	return json::sax_parse(file.data, file.data + file.size, &streamer);
+}
+
+size_t peakMemoryUsage() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+#  ifdef __APPLE__
+	return size_t(usage.ru_maxrss);
+#  else
+	return size_t(usage.ru_maxrss) * 1024;
+#  endif
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef SCENELOADER_H
+#define SCENELOADER_H
+
+#include "json.hpp"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+// SAX handler for scene files. Everything small (camera, lights, materials, the fields
+// of each object) is built into a json DOM as usual, but each entry of "objects" is
+// handed to addObject as soon as it has been parsed and then thrown away, and the
+// "triangles" and "uvCoords" arrays of those objects are never built as json at all:
+// their numbers are streamed straight into flat float arrays (9 floats per triangle,
+// 6 per set of uvs). Peak memory is then about one object's geometry rather than
+// several copies of the whole file.
+class SceneStreamer : public nlohmann::json_sax<json> {
+public:
+	typedef std::function<void(json& object, std::vector<float>& triangles, std::vector<float>& uvCoords)> ObjectHandler;
+	json scene; // everything except the entries of "objects"
+	std::string error;
+	SceneStreamer(ObjectHandler addObject);
+	bool null();
+	bool boolean(bool val);
+	bool number_integer(number_integer_t val);
+	bool number_unsigned(number_unsigned_t val);
+	bool number_float(number_float_t val, const string_t& s);
+	bool string(string_t& val);
+	bool start_object(std::size_t elements);
+	bool key(string_t& val);
+	bool end_object();
+	bool start_array(std::size_t elements);
+	bool end_array();
+	bool parse_error(std::size_t position, const std::string& last_token, const nlohmann::detail::exception& ex);
+private:
+	ObjectHandler addObject;
+	json object;
+	std::vector<float> triangles;
+	std::vector<float> uvCoords;
+	std::vector<json*> stack;	// containers being built
+	json* element;				// where the value after an object key goes
+	int depth;
+	bool objectsNext;			// the next value is the top level "objects" array
+	bool inObjects;
+	std::vector<float>* stream;	// numbers go here while inside a streamed array
+	int streamDepth;
+	json* addValue(json value);
+	bool addNumber(float value, json jsonValue);
+};
+
+bool loadScene(std::string filename, SceneStreamer& streamer);
+
+size_t peakMemoryUsage(); // bytes
+
+#endif
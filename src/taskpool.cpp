@@ -0,0 +1,83 @@
+#include "taskpool.h"
+
+#include <algorithm>
+
+TaskPool taskPool;
+
+TaskGroup::TaskGroup() : pending(0) {
+}
+
+TaskPool::TaskPool(int threads) : stopping(false) {
+	threadCount = threads > 0 ? threads : std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+TaskPool::~TaskPool() {
+	// tasks not yet started are dropped; at exit nothing is waiting for them
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		queue.clear();
+	}
+	available.notify_all();
+	for (int i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+void TaskPool::run(std::function<void()> task, TaskGroup* group) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (workers.empty()) {
+			for (int i = 0; i < threadCount; i++)
+				workers.push_back(std::thread(&TaskPool::work, this));
+		}
+
+		Task queued = { task, group };
+		queue.push_back(queued);
+		if (group != NULL)
+			group->pending++;
+	}
+	available.notify_one();
+}
+
+void TaskPool::wait(TaskGroup& group) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (group.pending > 0) {
+		// only this group's tasks are taken, so a long unrelated task can't hold the wait up
+		std::deque<Task>::iterator it = queue.begin();
+		while (it != queue.end() && it->group != &group)
+			++it;
+
+		if (it != queue.end()) {
+			Task task = *it;
+			queue.erase(it);
+			execute(task, lock);
+		}
+		else
+			finished.wait(lock);
+	}
+}
+
+void TaskPool::work() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		while (queue.empty() && !stopping)
+			available.wait(lock);
+		if (stopping)
+			return;
+
+		Task task = queue.front();
+		queue.pop_front();
+		execute(task, lock);
+	}
+}
+
+void TaskPool::execute(Task& task, std::unique_lock<std::mutex>& lock) {
+	lock.unlock();
+	task.run();
+	lock.lock();
+
+	if (task.group != NULL) {
+		task.group->pending--;
+		finished.notify_all();
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A set of tasks that can be waited for together.
+class TaskGroup {
+public:
+	TaskGroup();
+private:
+	friend class TaskPool;
+	int pending; // guarded by the pool's mutex
+};
+
+// A fixed set of worker threads running queued tasks in order. Scene loading uses it to
+// decode textures, import meshes and build the BVH alongside parsing. A thread waiting
+// for a group runs that group's queued tasks itself, so tasks can wait for other
+// tasks without tying up the workers.
+class TaskPool {
+public:
+	TaskPool(int threads = 0); // one per hardware thread by default
+	~TaskPool();
+	void run(std::function<void()> task, TaskGroup* group = NULL);
+	void wait(TaskGroup& group);
+private:
+	struct Task {
+		std::function<void()> run;
+		TaskGroup* group;
+	};
+	int threadCount;
+	std::mutex mutex;
+	std::condition_variable available;	// a task was queued, or the pool is stopping
+	std::condition_variable finished;	// a task of some group finished
+	std::deque<Task> queue;
+	std::vector<std::thread> workers;	// started on first use
+	bool stopping;
+	void work();
+	void execute(Task& task, std::unique_lock<std::mutex>& lock);
+	TaskPool(const TaskPool&);
+	TaskPool& operator=(const TaskPool&);
+};
+
+extern TaskPool taskPool;
+
+#endif
@@ -0,0 +1,393 @@
+#include "texture.h"
+#include "mappedfile.h"
+#include "EasyBMP/EasyBMP.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+uint32_t packRGBA8(colour3 colour) {
+	uint32_t r = uint32_t(glm::clamp(colour.r, 0.0f, 1.0f) * 255 + 0.5f);
+	uint32_t g = uint32_t(glm::clamp(colour.g, 0.0f, 1.0f) * 255 + 0.5f);
+	uint32_t b = uint32_t(glm::clamp(colour.b, 0.0f, 1.0f) * 255 + 0.5f);
+	return r | (g << 8) | (b << 16) | (255u << 24);
+}
+
+colour3 unpackRGBA8(uint32_t texel) {
+	return colour3(float(texel & 0xff), float((texel >> 8) & 0xff), float((texel >> 16) & 0xff)) * (1.0f / 255);
+}
+
+uint32_t packGradient(colour3 gradient) {
+	// differences of 8 bit heights are multiples of 1/255, which 16 bits hold almost exactly
+	int16_t du = int16_t(std::floor(glm::clamp(gradient.x, -1.0f, 1.0f) * 32767 + 0.5f));
+	int16_t dv = int16_t(std::floor(glm::clamp(gradient.y, -1.0f, 1.0f) * 32767 + 0.5f));
+	return uint32_t(uint16_t(du)) | (uint32_t(uint16_t(dv)) << 16);
+}
+
+colour3 unpackGradient(uint32_t texel) {
+	return colour3(float(int16_t(texel & 0xffff)), float(int16_t(texel >> 16)), 0) * (1.0f / 32767);
+}
+
+/****************************************************************************/
+
+// Block compression
+
+static std::atomic<uint32_t> nextLevelId(1);
+
+struct DecodedBlock {
+	uint64_t tag = 0;
+	uint32_t texels[TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE];
+};
+
+static thread_local DecodedBlock blockCache[TEXTURE_BLOCK_CACHE_SIZE];
+
+static uint32_t packRGB565(glm::ivec3 c) {
+	return ((c.r * 31 + 127) / 255 << 11) | ((c.g * 63 + 127) / 255 << 5) | ((c.b * 31 + 127) / 255);
+}
+
+static glm::ivec3 unpackRGB565(uint32_t c) {
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	return glm::ivec3((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+}
+
+static glm::ivec3 unpackRGB(uint32_t texel) {
+	return glm::ivec3(texel & 0xff, (texel >> 8) & 0xff, (texel >> 16) & 0xff);
+}
+
+static void blockPalette(uint64_t block, glm::ivec3 palette[4]) {
+	palette[0] = unpackRGB565(uint32_t(block & 0xffff));
+	palette[1] = unpackRGB565(uint32_t((block >> 16) & 0xffff));
+	palette[2] = (palette[0] * 2 + palette[1] + 1) / 3;
+	palette[3] = (palette[0] + palette[1] * 2 + 1) / 3;
+}
+
+// picks the nearest palette entry for each texel, returning the squared error
+static int assignIndices(const glm::ivec3 colours[], uint64_t& block) {
+	glm::ivec3 palette[4];
+	blockPalette(block, palette);
+	block &= 0xffffffff;
+
+	int error = 0;
+	for (int i = 0; i < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; i++) {
+		int best = 0, bestDistance = 1 << 30;
+		for (int k = 0; k < 4; k++) {
+			glm::ivec3 d = colours[i] - palette[k];
+			int distance = d.r * d.r + d.g * d.g + d.b * d.b;
+			if (distance < bestDistance) {
+				bestDistance = distance;
+				best = k;
+			}
+		}
+		block |= uint64_t(best) << (32 + 2 * i);
+		error += bestDistance;
+	}
+	return error;
+}
+
+static uint64_t encodeBlock(const uint32_t texels[TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE]) {
+	glm::ivec3 colours[TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE];
+	for (int i = 0; i < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; i++)
+		colours[i] = unpackRGB(texels[i]);
+
+	// start from the two texels furthest apart
+	int first = 0, second = 0, furthest = -1;
+	for (int i = 0; i < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; i++) {
+		for (int j = i + 1; j < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; j++) {
+			glm::ivec3 d = colours[i] - colours[j];
+			int distance = d.r * d.r + d.g * d.g + d.b * d.b;
+			if (distance > furthest) {
+				furthest = distance;
+				first = i;
+				second = j;
+			}
+		}
+	}
+
+	uint64_t block = packRGB565(colours[first]) | (uint64_t(packRGB565(colours[second])) << 16);
+	int error = assignIndices(colours, block);
+
+	// then refit the end points to the chosen indices by least squares, while that helps
+	const float weights[4] = { 1.0f, 0.0f, 2.0f / 3, 1.0f / 3 };
+	for (int iteration = 0; iteration < 2 && error > 0; iteration++) {
+		float aa = 0, ab = 0, bb = 0;
+		glm::vec3 ac(0), bc(0);
+		for (int i = 0; i < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; i++) {
+			float a = weights[(block >> (32 + 2 * i)) & 3];
+			float b = 1 - a;
+			aa += a * a;
+			ab += a * b;
+			bb += b * b;
+			ac += a * glm::vec3(colours[i]);
+			bc += b * glm::vec3(colours[i]);
+		}
+
+		float det = aa * bb - ab * ab;
+		if (std::abs(det) < 1e-6f)
+			break;
+
+		glm::vec3 e0 = glm::clamp((bb * ac - ab * bc) / det, 0.0f, 255.0f);
+		glm::vec3 e1 = glm::clamp((aa * bc - ab * ac) / det, 0.0f, 255.0f);
+		uint64_t refit = packRGB565(glm::ivec3(e0 + 0.5f)) | (uint64_t(packRGB565(glm::ivec3(e1 + 0.5f))) << 16);
+		int refitError = assignIndices(colours, refit);
+		if (refitError >= error)
+			break;
+		block = refit;
+		error = refitError;
+	}
+	return block;
+}
+
+static void decodeBlock(uint64_t block, uint32_t texels[TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE]) {
+	glm::ivec3 palette[4];
+	blockPalette(block, palette);
+
+	uint32_t packed[4];
+	for (int k = 0; k < 4; k++)
+		packed[k] = palette[k].r | (palette[k].g << 8) | (palette[k].b << 16) | (255u << 24);
+
+	for (int i = 0; i < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; i++)
+		texels[i] = packed[(block >> (32 + 2 * i)) & 3];
+}
+
+/****************************************************************************/
+
+// MipLevel
+
+void MipLevel::resize(int width, int height) {
+	this->width = width;
+	this->height = height;
+	tilesX = (width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+	int tilesY = (height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+	texels.assign(tilesX * tilesY * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE, 0);
+	blocks.clear();
+}
+
+uint32_t& MipLevel::at(int x, int y) {
+	int tile = (y / TEXTURE_TILE_SIZE) * tilesX + x / TEXTURE_TILE_SIZE;
+	int offset = (y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE;
+	return texels[tile * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE + offset];
+}
+
+void MipLevel::compress() {
+	blocksX = (width + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+	int blocksY = (height + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+	blocks.resize(blocksX * blocksY);
+
+	for (int by = 0; by < blocksY; by++) {
+		for (int bx = 0; bx < blocksX; bx++) {
+			// blocks hanging over the edge repeat the edge texels
+			uint32_t block[TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE];
+			for (int i = 0; i < TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE; i++) {
+				int x = std::min(bx * TEXTURE_BLOCK_SIZE + i % TEXTURE_BLOCK_SIZE, width - 1);
+				int y = std::min(by * TEXTURE_BLOCK_SIZE + i / TEXTURE_BLOCK_SIZE, height - 1);
+				block[i] = at(x, y);
+			}
+			blocks[by * blocksX + bx] = encodeBlock(block);
+		}
+	}
+
+	std::vector<uint32_t>().swap(texels);
+	id = nextLevelId++;
+}
+
+colour3 MipLevel::fetch(int x, int y) {
+	x = std::min(std::max(x, 0), width - 1);
+	y = std::min(std::max(y, 0), height - 1);
+	if (format == TextureGradient)
+		return unpackGradient(at(x, y));
+	if (blocks.empty())
+		return unpackRGBA8(at(x, y));
+
+	// find the block in the cache, decoding it if another block has taken its slot
+	uint32_t index = (y / TEXTURE_BLOCK_SIZE) * blocksX + x / TEXTURE_BLOCK_SIZE;
+	uint64_t tag = (uint64_t(id) << 32) | index;
+	DecodedBlock& cached = blockCache[(index ^ (id * 97)) % TEXTURE_BLOCK_CACHE_SIZE];
+	if (cached.tag != tag) {
+		decodeBlock(blocks[index], cached.texels);
+		cached.tag = tag;
+	}
+	return unpackRGBA8(cached.texels[(y % TEXTURE_BLOCK_SIZE) * TEXTURE_BLOCK_SIZE + x % TEXTURE_BLOCK_SIZE]);
+}
+
+/****************************************************************************/
+
+// Texture
+
+static uint32_t read16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t read32(const unsigned char* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+static bool readBMP(std::string filename, MipLevel& level) {
+	// Fast path for uncompressed 24 and 32 bit BMPs: the file is memory mapped and decoded
+	// a row at a time, each run of pixels going straight into its tile.
+	MappedFile file;
+	if (!file.open(filename) || file.size < 54)
+		return false;
+
+	const unsigned char* data = file.data;
+	if (data[0] != 'B' || data[1] != 'M' || read32(data + 14) < 40)
+		return false;
+
+	uint32_t offset = read32(data + 10);
+	int width = int(read32(data + 18));
+	int height = int(read32(data + 22));
+	int bitDepth = read16(data + 28);
+	uint32_t compression = read32(data + 30);
+
+	if (compression != 0 || (bitDepth != 24 && bitDepth != 32) || width <= 0 || height == 0)
+		return false;
+
+	// rows are stored bottom up unless the height is negative
+	bool topDown = height < 0;
+	height = abs(height);
+
+	int bytesPerPixel = bitDepth / 8;
+	size_t stride = (size_t(width) * bytesPerPixel + 3) & ~size_t(3);
+	if (offset + stride * height > file.size)
+		return false;
+
+	level.resize(width, height);
+
+	for (int y = 0; y < height; y++) {
+		const unsigned char* row = data + offset + stride * (topDown ? y : height - 1 - y);
+
+		for (int x = 0; x < width; x += TEXTURE_TILE_SIZE) {
+			uint32_t* texels = &level.at(x, y);
+			const unsigned char* pixel = row + x * bytesPerPixel;
+			int run = std::min(TEXTURE_TILE_SIZE, width - x);
+
+			for (int i = 0; i < run; i++, pixel += bytesPerPixel)
+				texels[i] = pixel[2] | (pixel[1] << 8) | (pixel[0] << 16) | (255u << 24);
+		}
+	}
+	return true;
+}
+
+Texture::Texture() : format(TextureColour) {
+}
+
+bool Texture::load(std::string filename, TextureFormat format) {
+	this->format = TextureColour;
+	levels.resize(1);
+	MipLevel& base = levels[0];
+	base.format = TextureColour;
+	bool result = readBMP(filename, base);
+
+	if (!result) {
+		// anything the fast path doesn't handle goes through EasyBMP
+		BMP bmp;
+		result = bmp.ReadFromFile(filename.c_str());
+		base.resize(bmp.TellWidth(), bmp.TellHeight());
+
+		for (int y = 0; y < base.height; y++) {
+			for (int x = 0; x < base.width; x++) {
+				RGBApixel* pixel = bmp(x, y);
+				base.at(x, y) = pixel->Red | (pixel->Green << 8) | (pixel->Blue << 16) | (255u << 24);
+			}
+		}
+	}
+
+	if (format == TextureGradient)
+		buildGradients();
+
+	buildMipmaps();
+	return result;
+}
+
+void Texture::compress() {
+	if (format != TextureColour || compressed())
+		return;
+	for (int i = 0; i < levels.size(); i++)
+		levels[i].compress();
+}
+
+bool Texture::compressed() {
+	return !levels[0].blocks.empty();
+}
+
+size_t Texture::memorySize() {
+	size_t size = 0;
+	for (int i = 0; i < levels.size(); i++)
+		size += levels[i].texels.size() * sizeof(uint32_t) + levels[i].blocks.size() * sizeof(uint64_t);
+	return size;
+}
+
+void Texture::buildGradients() {
+	// differences wrap around in both directions, as the bump map lookups always have
+	MipLevel heights = levels[0];
+	MipLevel& base = levels[0];
+	base.format = format = TextureGradient;
+
+	for (int y = 0; y < base.height; y++) {
+		for (int x = 0; x < base.width; x++) {
+			float value = heights.fetch(x, y).r;
+			float value_u = heights.fetch((x + 1) % base.width, y).r;
+			float value_v = heights.fetch(x, (y + 1) % base.height).r;
+			base.at(x, y) = packGradient(colour3(value_u - value, value_v - value, 0));
+		}
+	}
+}
+
+void Texture::buildMipmaps() {
+	// each level averages 2x2 blocks of the one above, down to a single texel
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		levels.push_back(MipLevel());
+		MipLevel& above = levels[levels.size() - 2];
+		MipLevel& level = levels.back();
+		level.format = format;
+		level.resize(std::max(above.width / 2, 1), std::max(above.height / 2, 1));
+
+		for (int y = 0; y < level.height; y++) {
+			for (int x = 0; x < level.width; x++) {
+				colour3 total = above.fetch(2 * x, 2 * y) + above.fetch(2 * x + 1, 2 * y) + above.fetch(2 * x, 2 * y + 1) + above.fetch(2 * x + 1, 2 * y + 1);
+				level.at(x, y) = format == TextureGradient ? packGradient(total / 4.0f) : packRGBA8(total / 4.0f);
+			}
+		}
+	}
+}
+
+int Texture::width() {
+	return levels[0].width;
+}
+
+int Texture::height() {
+	return levels[0].height;
+}
+
+colour3 Texture::texel(int x, int y) {
+	return levels[0].fetch(x, y);
+}
+
+colour3 Texture::bilinear(int level, float u, float v) {
+	MipLevel& mip = levels[level];
+
+	// texel centres are at half-integer coordinates
+	float x = u * mip.width - 0.5f;
+	float y = v * mip.height - 0.5f;
+	int x0 = int(std::floor(x));
+	int y0 = int(std::floor(y));
+	float fx = x - x0;
+	float fy = y - y0;
+
+	colour3 top = mip.fetch(x0, y0) * (1 - fx) + mip.fetch(x0 + 1, y0) * fx;
+	colour3 bottom = mip.fetch(x0, y0 + 1) * (1 - fx) + mip.fetch(x0 + 1, y0 + 1) * fx;
+	return top * (1 - fy) + bottom * fy;
+}
+
+colour3 Texture::sample(float u, float v, float footprint) {
+	// choose the level whose texels are about as wide as the footprint, and blend between the two nearest
+	float lod = std::log2(std::max(footprint * std::sqrt(float(width()) * height()), 1e-8f));
+	lod = glm::clamp(lod, 0.0f, float(levels.size() - 1));
+
+	int level = int(lod);
+	float blend = lod - level;
+
+	if (blend == 0 || level + 1 >= levels.size())
+		return bilinear(level, u, v);
+
+	return bilinear(level, u, v) * (1 - blend) + bilinear(level + 1, u, v) * blend;
+}
@@ -0,0 +1,68 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define TEXTURE_TILE_SIZE 8 // texels are stored in square tiles so filtered lookups stay within a few cache lines
+#define TEXTURE_BLOCK_SIZE 4 // compressed textures store 4x4 texel blocks in 64 bits
+#define TEXTURE_BLOCK_CACHE_SIZE 256 // decoded blocks kept per thread
+
+typedef glm::vec3 colour3;
+
+enum TextureFormat {
+	TextureColour,	// RGBA8
+	TextureGradient	// forward differences of the red channel as a height field, two signed 16 bit values
+};
+
+// One level of a mip pyramid, stored as packed RGBA8 texels in row-major tiles. Once
+// compressed the texels are replaced by blocks with two RGB565 end points and a 2 bit
+// index per texel choosing between them and two colours in between (as in BC1), which
+// are decoded on lookup through a small per-thread cache of recently used blocks.
+struct MipLevel {
+	TextureFormat format;
+	int width;
+	int height;
+	int tilesX;
+	std::vector<uint32_t> texels;
+	int blocksX;
+	std::vector<uint64_t> blocks;
+	uint32_t id; // tags this level's blocks in the block cache
+	void resize(int width, int height);
+	uint32_t& at(int x, int y); // uncompressed levels only
+	void compress();
+	colour3 fetch(int x, int y); // clamps to the edges; gradients come back as (du, dv, 0)
+};
+
+// A texture converted once at load time from the BMP file, with a full mip pyramid.
+// (u,v) = (0,0) is the top left corner of the image, matching EasyBMP pixel order.
+// Loaded as TextureGradient the image is treated as a height map, and each texel holds
+// its height difference to the next texel in u and in v, so that bump mapping needs just
+// one filtered lookup.
+class Texture {
+public:
+	TextureFormat format;
+	std::vector<MipLevel> levels;
+	Texture();
+	bool load(std::string filename, TextureFormat format = TextureColour);
+	void compress(); // colour textures only
+	bool compressed();
+	size_t memorySize();
+	int width();
+	int height();
+	colour3 texel(int x, int y); // unfiltered texel from the full resolution level
+	colour3 bilinear(int level, float u, float v);
+	colour3 sample(float u, float v, float footprint); // trilinear; footprint is the lookup width in uv units
+private:
+	void buildGradients();
+	void buildMipmaps();
+};
+
+uint32_t packRGBA8(colour3 colour);
+colour3 unpackRGBA8(uint32_t texel);
+uint32_t packGradient(colour3 gradient);
+colour3 unpackGradient(uint32_t texel);
+
+#endif
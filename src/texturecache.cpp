@@ -0,0 +1,215 @@
+#include "texturecache.h"
+#include "sampler.h"
+#include "taskpool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+TextureCache textureCache;
+
+// a texture a thread looked up, which it uses again without locking until anything has been
+// evicted, or it has been used TEXTURE_CACHE_REFRESH times and goes back to the cache to
+// stay recently used
+struct TextureSlot {
+	TextureCacheEntry* entry = NULL;
+	std::shared_ptr<Texture> texture;
+	int uses = 0;
+};
+
+static thread_local TextureSlot threadSlots[TEXTURE_CACHE_THREAD_SLOTS];
+static thread_local unsigned threadSlotsGeneration = 0; // the generation all of the thread's slots were filled in
+
+TextureCache::TextureCache() : budget(TEXTURE_CACHE_BUDGET), compress(false), waitForLoads(true), used(0), loads(0), evictions(0), generation(0) {
+}
+
+TextureCacheEntry* TextureCache::find(std::string path, TextureFormat format) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	std::string key = format == TextureGradient ? path + "#gradient" : path;
+	std::map<std::string, TextureCacheEntry*>::iterator it = entries.find(key);
+	if (it != entries.end())
+		return it->second;
+
+	TextureCacheEntry* entry = new TextureCacheEntry();
+	entry->path = path;
+	entry->format = format;
+	entry->loading = false;
+	entry->queued = false;
+	entry->lruPosition = lru.end();
+	entries[key] = entry;
+	return entry;
+}
+
+std::shared_ptr<Texture> TextureCache::acquire(TextureCacheEntry* entry) {
+	return acquire(entry, waitForLoads);
+}
+
+std::shared_ptr<Texture> TextureCache::acquire(TextureCacheEntry* entry, bool wait) {
+	// after an eviction every slot is dropped, so none keeps an evicted texture alive
+	unsigned current = generation.load(std::memory_order_acquire);
+	if (threadSlotsGeneration != current) {
+		for (int i = 0; i < TEXTURE_CACHE_THREAD_SLOTS; i++) {
+			threadSlots[i].entry = NULL;
+			threadSlots[i].texture.reset();
+		}
+		threadSlotsGeneration = current;
+	}
+
+	TextureSlot& slot = threadSlots[(uintptr_t(entry) / sizeof(TextureCacheEntry)) % TEXTURE_CACHE_THREAD_SLOTS];
+	if (slot.entry == entry && ++slot.uses < TEXTURE_CACHE_REFRESH)
+		return slot.texture;
+
+	std::shared_ptr<Texture> texture;
+	if (claim(entry, wait, texture))
+		texture = load(entry);
+
+	// the generation was read first, so an eviction during the lookup drops the slot next time
+	slot.entry = texture ? entry : NULL;
+	slot.texture = texture;
+	slot.uses = 0;
+	return texture;
+}
+
+bool TextureCache::prefetch(TextureCacheEntry* entry, std::function<void()> done) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (entry->loading || entry->texture)
+			return false;
+		entry->loading = true;
+		entry->queued = true;
+	}
+
+	taskPool.run([=]() {
+		std::shared_ptr<Texture> texture;
+		if (claim(entry, true, texture))
+			load(entry);
+		if (done)
+			done();
+	});
+	return true;
+}
+
+// Returns true if the caller is to decode the texture itself. Otherwise texture is set
+// to the loaded texture, after waiting for another thread to finish decoding it, or
+// left NULL if it's still loading and wait is off.
+bool TextureCache::claim(TextureCacheEntry* entry, bool wait, std::shared_ptr<Texture>& texture) {
+	std::unique_lock<std::mutex> lock(mutex);
+
+	if (entry->loading && !wait)
+		return false;
+
+	// a prefetch that hasn't started yet is taken over, so nothing waits on the task queue
+	if (entry->queued) {
+		entry->queued = false;
+		return true;
+	}
+
+	while (entry->loading)
+		loaded.wait(lock);
+	if (entry->texture) {
+		lru.splice(lru.begin(), lru, entry->lruPosition);
+		texture = entry->texture;
+		return false;
+	}
+
+	entry->loading = true;
+	return true;
+}
+
+// Decodes a texture its caller has marked as loading and adds it to the cache.
+std::shared_ptr<Texture> TextureCache::load(TextureCacheEntry* entry) {
+	// decode outside the lock so lookups of other textures aren't held up
+	std::shared_ptr<Texture> texture(new Texture());
+	if (!texture->load(entry->path, entry->format))
+		std::cout << "Unable to load texture " << entry->path << std::endl;
+	if (compress)
+		texture->compress();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	entry->loading = false;
+	loaded.notify_all();
+
+	entry->texture = texture;
+	lru.push_front(entry);
+	entry->lruPosition = lru.begin();
+	used += texture->memorySize();
+	loads++;
+
+	// textures still in use elsewhere are only freed once released there
+	while (used > budget && lru.back() != entry) {
+		TextureCacheEntry* victim = lru.back();
+		used -= victim->texture->memorySize();
+		victim->texture.reset();
+		victim->lruPosition = lru.end();
+		lru.pop_back();
+		evictions++;
+		generation++;
+	}
+
+	return texture;
+}
+
+void TextureCache::printStats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (loads > 0 || evictions > 0)
+		std::cout << "Texture cache: " << lru.size() << " of " << entries.size() << " textures resident (" << (used >> 20) << " of " << (budget >> 20) << " MB), " << loads << " loads, " << evictions << " evictions" << std::endl;
+	loads = 0;
+	evictions = 0;
+}
+
+// time random trilinear lookups spread over the whole mip range
+static double lookupTime(Texture& texture, int lookups, colour3& total) {
+	RNG rng(1);
+	std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < lookups; i++) {
+		float u = rng.nextFloat();
+		float v = rng.nextFloat();
+		float footprint = std::pow(2.0f, -12 * rng.nextFloat());
+		total += texture.sample(u, v, footprint);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+	return elapsed.count();
+}
+
+void TextureCache::benchmark() {
+	std::vector<std::string> paths;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (std::map<std::string, TextureCacheEntry*>::iterator it = entries.begin(); it != entries.end(); ++it)
+			if (it->second->format == TextureColour)
+				paths.push_back(it->second->path);
+	}
+
+	const int lookups = 1 << 22;
+	size_t plainTotal = 0, compressedTotal = 0;
+
+	for (int i = 0; i < paths.size(); i++) {
+		Texture plain, compressed;
+		plain.load(paths[i]);
+		compressed.load(paths[i]);
+		compressed.compress();
+
+		// the error of the compressed base level, in 8 bit steps
+		double error = 0;
+		for (int y = 0; y < plain.height(); y++)
+			for (int x = 0; x < plain.width(); x++) {
+				colour3 d = (plain.texel(x, y) - compressed.texel(x, y)) * 255.0f;
+				error += glm::dot(d, d) / 3;
+			}
+		error = std::sqrt(error / (plain.width() * plain.height()));
+
+		colour3 total;
+		double plainTime = lookupTime(plain, lookups, total);
+		double compressedTime = lookupTime(compressed, lookups, total);
+
+		std::cout << paths[i] << ": " << (plain.memorySize() >> 10) << " KB -> " << (compressed.memorySize() >> 10) << " KB, "
+			<< plainTime * 1e9 / lookups << " -> " << compressedTime * 1e9 / lookups << " ns per lookup, rms error " << error << std::endl;
+
+		plainTotal += plain.memorySize();
+		compressedTotal += compressed.memorySize();
+	}
+
+	if (compressedTotal > 0)
+		std::cout << "Compression saves " << ((plainTotal - compressedTotal) >> 10) << " KB (" << float(plainTotal) / compressedTotal << ":1)" << std::endl;
+}
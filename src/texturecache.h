@@ -0,0 +1,64 @@
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include "texture.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#define TEXTURE_CACHE_BUDGET (size_t(512) << 20) // bytes of decoded texels kept resident
+#define TEXTURE_CACHE_THREAD_SLOTS 4 // textures each thread keeps at hand, looked up without locking
+#define TEXTURE_CACHE_REFRESH 4096 // lookups a thread serves itself before marking the texture used again
+
+struct TextureCacheEntry {
+	std::string path;
+	TextureFormat format;
+	std::shared_ptr<Texture> texture; // NULL until first used, and again after eviction
+	bool loading; // being decoded by some thread, which the others wait for
+	bool queued; // prefetched but not started, so the first thread to want it can decode it
+	std::list<TextureCacheEntry*>::iterator lruPosition;
+};
+
+// Process-wide cache of textures keyed by path and format. Objects hold an entry, which costs
+// nothing until the texture is first looked up; it is then decoded once and shared by
+// every object using the same file, with other threads wanting it meanwhile waiting for
+// the decode to finish. Least recently used textures are evicted when the
+// decoded texels exceed the memory budget, and reloaded if they are needed again.
+// With compress set, colour textures are block compressed as they are loaded.
+// Textures can also be prefetched, so they are decoded in the background before
+// they are first needed. Each thread keeps the last few textures it looked up, so shading
+// doesn't take the cache lock for every texel.
+class TextureCache {
+public:
+	size_t budget;
+	bool compress;
+	bool waitForLoads; // if not, looking up a texture that is still loading gives NULL
+	TextureCache();
+	TextureCacheEntry* find(std::string path, TextureFormat format = TextureColour);
+	std::shared_ptr<Texture> acquire(TextureCacheEntry* entry);
+	std::shared_ptr<Texture> acquire(TextureCacheEntry* entry, bool wait);
+	bool prefetch(TextureCacheEntry* entry, std::function<void()> done = NULL); // loads on the task pool; false if already loaded or loading
+	void printStats();
+	void benchmark(); // compares memory and lookup speed of plain and compressed copies of the loaded textures
+private:
+	std::mutex mutex;
+	std::condition_variable loaded;
+	std::map<std::string, TextureCacheEntry*> entries;
+	std::list<TextureCacheEntry*> lru; // loaded entries, most recently used first
+	size_t used;
+	int loads;
+	int evictions;
+	std::atomic<unsigned> generation; // changes whenever a texture is evicted, which threads' own copies check
+	bool claim(TextureCacheEntry* entry, bool wait, std::shared_ptr<Texture>& texture);
+	std::shared_ptr<Texture> load(TextureCacheEntry* entry);
+};
+
+extern TextureCache textureCache;
+
+#endif
@@ -1,18 +1,16 @@
 #include "texturemesh.h"
+#include "raytracer.h"
 
 TextureMesh::TextureMesh(Material material, std::string texturefile) : Mesh::Mesh(material) {
-	this->texture.ReadFromFile(texturefile.c_str());
+	// the texture is only decoded when it is first looked up
+	this->texture = textureCache.find(texturefile);
 }
 
-void TextureMesh::getTexValue(float u, float v, colour3& colour) {
-	// get the colour value at coordinates (u,v) in the texture map
-	int height = texture.TellHeight();
-	int width = texture.TellWidth();
-
-	RGBApixel* pixel = texture(int(u * width), int(v * height));
-	colour.r = float(pixel->Red) / 255;
-	colour.g = float(pixel->Green) / 255;
-	colour.b = float(pixel->Blue) / 255;
+void TextureMesh::getTexValue(float u, float v, float footprint, colour3& colour) {
+	// get the filtered colour value at coordinates (u,v) in the texture map,
+	// or the plain material colour if the texture is still streaming in
+	std::shared_ptr<Texture> map = textureCache.acquire(texture);
+	colour = map ? map->sample(u, v, footprint) : material.diffuse;
 }
 
 TextureTriangle::TextureTriangle(Mesh* mesh, point3 p0, point3 p1, point3 p2, uvCoord uv0, uvCoord uv1, uvCoord uv2, Material material) :
@@ -20,11 +18,24 @@ TextureTriangle::TextureTriangle(Mesh* mesh, point3 p0, point3 p1, point3 p2, uv
 	uvCoords[0] = uv0;
 	uvCoords[1] = uv1;
 	uvCoords[2] = uv2;
+
+	float uvArea = abs((uv1.x - uv0.x) * (uv2.y - uv0.y) - (uv2.x - uv0.x) * (uv1.y - uv0.y));
+	float area = glm::length(glm::cross(p1 - p0, p2 - p0));
+	uvScale = area > 0 ? sqrt(uvArea / area) : 0;
 }
 
-void TextureTriangle::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick) {
+void TextureTriangle::lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick, colour3* albedo) {
 	// Set diffuse and ambient material properties to texture value, then call normal light function
+	colour3 texColour;
+	getAlbedo(d, texColour);
+
+	// set ambient and diffuse colours, then call superclass light function
+	material.ambient = texColour;
+	material.diffuse = texColour;
+	Triangle::lightPoint(e, d, Lights, colour, reflectionCount, pick, albedo);
+}
 
+void TextureTriangle::getAlbedo(point3 d, colour3& albedo) {
 	point3 p = cachedHitpoint;
 
 	// calculate barycentric coordinates
@@ -40,14 +51,12 @@ void TextureTriangle::lightPoint(point3 e, point3 d, std::vector<Light*> Lights,
 	// interpolate u,v coordinates
 	uvCoord uv = uvCoords[0] * a0 + uvCoords[1] * a1 + uvCoords[2] * a2;
 
+	// size of the ray's footprint in the texture, stretched by the angle it hits the triangle at
+	float cosine = std::max(abs(glm::dot(glm::normalize(d), normal)), 0.1f);
+	float footprint = hitFootprint() * uvScale / sqrt(cosine);
+
 	// get colour data from mesh
 	TextureMesh* mesh = (TextureMesh*)this->mesh;
-	colour3 texColour;
-	mesh->getTexValue(uv[0], uv[1], texColour);
-
-	// set ambient and diffuse colours, then call superclass light function
-	material.ambient = texColour;
-	material.diffuse = texColour;
-	Triangle::lightPoint(e, d, Lights, colour, reflectionCount, pick);
+	mesh->getTexValue(uv[0], uv[1], footprint, albedo);
 }
 
@@ -2,7 +2,7 @@
 #define TEXTUREMESH_H
 
 #include "objects.h"
-#include "EasyBMP/EasyBMP.h"
+#include "texturecache.h"
 #include <array>
 #include <string>
 
@@ -10,16 +10,18 @@ typedef glm::vec2 uvCoord;
 
 class TextureMesh : public Mesh {
 public:
-	BMP texture;
+	TextureCacheEntry* texture;
 	TextureMesh(Material material, std::string texturefile);
-	void getTexValue(float u, float v, colour3& colour);
+	void getTexValue(float u, float v, float footprint, colour3& colour);
 };
 
 class TextureTriangle : public Triangle {
 public:
 	std::array<uvCoord, 3> uvCoords;
+	float uvScale; // uv units per unit of distance on the triangle
 	TextureTriangle(Mesh* mesh, point3 p0, point3 p1, point3 p2, uvCoord uv0, uvCoord uv1, uvCoord uv2, Material material);
-	void lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick);
+	void lightPoint(point3 e, point3 d, std::vector<Light*> Lights, colour3& colour, int reflectionCount, bool pick, colour3* albedo = NULL);
+	void getAlbedo(point3 d, colour3& albedo); // the texture colour at the last hit, seen along d
 };
 
 #endif
\ No newline at end of file